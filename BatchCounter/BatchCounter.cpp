@@ -0,0 +1,211 @@
+#include "static.h"
+
+#include "BatchCounter.hpp"
+#include "WorkerPool.hpp"
+#include "CacheArchive.hpp"
+#include "TiledCounter.hpp"
+#include "Pretty.hpp"
+
+#include <qt-json/json.h>
+
+using namespace QtJson;
+
+// the timing columns, in pipeline order
+const char * BatchCounter::s_stages[] = { "decode", "lab", "classify", "count", 0 };
+
+static QStringList s_colorNames = QStringList() << "green" << "pink" << "yellow";
+static QStringList s_nameFilters = QStringList() << "*.jpg" << "*.JPG";
+
+BatchCounter::BatchCounter(const Options &options) :
+    m_options(options)
+{
+    if (m_options.paletteDirectory.isEmpty())
+        m_options.paletteDirectory = m_options.directory;
+}
+
+bool BatchCounter::run()
+{
+    QDir dir( m_options.directory );
+    if (!dir.exists()) {
+        m_error = QString("No such directory: %1").arg( m_options.directory );
+        return false;
+    }
+
+    QSharedPointer< QArtm::CountingEngine > engine( new QArtm::CountingEngine );
+    if (!engine->load( QDir(m_options.paletteDirectory) )) {
+        m_error = QString("No palette.png and flann.dat in %1, teach me the colors first")
+                .arg( m_options.paletteDirectory );
+        return false;
+    }
+
+    // one cache archive per event directory, shared with the gui
+    CacheArchivePtr archive( new QArtm::CacheArchive );
+    if (!archive->open( dir.filePath("cache.vca") )) {
+        m_error = QString("Can't open the cache archive of %1").arg( m_options.directory );
+        return false;
+    }
+
+    QStringList paths;
+    foreach(QString name, dir.entryList( s_nameFilters, QDir::Files, QDir::Name ))
+        paths << dir.filePath(name);
+
+    CountPhoto countPhoto;
+    countPhoto.engine = engine;
+    countPhoto.archive = archive;
+    countPhoto.parameters = m_options.parameters;
+    countPhoto.cachedOnly = m_options.processes > 0;
+    countPhoto.fullResolution = m_options.fullResolution;
+
+    QThreadPool::globalInstance()->setMaxThreadCount( qMax(1, m_options.jobs) );
+    QTime time;
+    time.start();
+    m_records = QtConcurrent::blockingMapped< QList< Record > >( paths, countPhoto );
+
+    // what isn't classified yet goes to the worker processes
+    if (m_options.processes > 0) {
+        QStringList uncached;
+        QList<int> indices;
+        for(int i = 0; i < m_records.size(); i++)
+            if (!m_records[i].cached) {
+                uncached << paths[i];
+                indices << i;
+            }
+        qDebug() << qPrintable( QString("%1 of %2 photos are cached, %3 go to %4 workers")
+                                .arg(paths.size() - uncached.size()).arg(paths.size())
+                                .arg(uncached.size()).arg(m_options.processes) );
+
+        WorkerPool pool( m_options, archive, engine->classificationKey( m_options.parameters.sizeLimit ) );
+        QList< Record > counted = pool.run( uncached );
+        for(int i = 0; i < counted.size(); i++)
+            m_records[ indices[i] ] = counted[i];
+    }
+
+    qDebug() << qPrintable( QString("Counted %1 photos in %2")
+                            .arg(m_records.size()).arg(QArtm::Pretty::ms( time.elapsed() )) );
+    int tiles = 0, reused = 0;
+    foreach(const Record& record, m_records) {
+        tiles += record.tiles;
+        reused += record.reusedTiles;
+    }
+    if (tiles)
+        qDebug() << qPrintable( QString("Reused %1 of %2 classified tiles (%3%) from previous photos")
+                                .arg(reused).arg(tiles).arg( 100.0 * reused / tiles, 0, 'f', 1 ) );
+    return true;
+}
+
+BatchCounter::Record BatchCounter::CountPhoto::operator()(const QString &path) const
+{
+    // nothing at full resolution is cached, it all goes to the workers
+    if (fullResolution)
+        return cachedOnly ? Record() : countFullResolution( *engine, path, parameters );
+
+    Record record;
+    record.path = path;
+
+    QTime time;
+    time.start();
+    QArtm::CountingEngine::Result result = engine->count( archive, path, parameters, cachedOnly );
+    record.total = time.elapsed();
+
+    // a photo that can't be decoded has no classification
+    record.ok = !result.indices.empty();
+    if (record.ok) {
+        record.cached = !result.timings.contains("classify");
+        record.counts = result.counts();
+        record.timings = result.timings;
+        record.tiles = result.tiles;
+        record.reusedTiles = result.reusedTiles;
+    } else if (!cachedOnly) {
+        qWarning() << "Can't count" << qPrintable(path);
+    }
+    return record;
+}
+
+BatchCounter::Record countFullResolution(const QArtm::CountingEngine &engine, const QString &path,
+                                         const QArtm::CountingEngine::Parameters &parameters)
+{
+    BatchCounter::Record record;
+    record.path = path;
+
+    QTime time;
+    time.start();
+    QArtm::CountingEngine::Result result;
+    record.ok = QArtm::TiledCounter( engine ).count( path, parameters, result );
+    record.total = time.elapsed();
+    if (record.ok) {
+        record.counts = result.counts();
+        record.timings = result.timings;
+    } else {
+        qWarning() << "Can't count" << qPrintable(path);
+    }
+    return record;
+}
+
+QByteArray BatchCounter::csv() const
+{
+    QStringList header;
+    header << "file" << "ok" << "cached" << s_colorNames;
+    for(int i = 0; s_stages[i]; i++)
+        header << QString("%1_ms").arg(s_stages[i]);
+    header << "total_ms";
+
+    QStringList lines;
+    lines << header.join(",");
+    foreach(const Record& record, m_records) {
+        QStringList fields;
+        QString name = QFileInfo(record.path).fileName();
+        fields << "\"" + name.replace("\"", "\"\"") + "\"" << QString::number( record.ok )
+               << QString::number( record.cached );
+        for(int i = 0; i < s_colorNames.size(); i++)
+            fields << (i < record.counts.size() ? QString::number( record.counts[i] ) : QString());
+        // stages the photo didn't go through, because of the cache, stay empty
+        for(int i = 0; s_stages[i]; i++)
+            fields << (record.timings.contains( s_stages[i] ) ? QString::number( record.timings[s_stages[i]] ) : QString());
+        fields << QString::number( record.total );
+        lines << fields.join(",");
+    }
+    return (lines.join("\n") + "\n").toUtf8();
+}
+
+QByteArray BatchCounter::json() const
+{
+    QVariantList objects;
+    foreach(const Record& record, m_records) {
+        QVariantMap object;
+        object["file"] = QFileInfo(record.path).fileName();
+        object["ok"] = record.ok;
+        object["cached"] = record.cached;
+
+        QVariantMap counts;
+        for(int i = 0; i < record.counts.size() && i < s_colorNames.size(); i++)
+            counts[ s_colorNames[i] ] = record.counts[i];
+        object["counts"] = counts;
+
+        QVariantMap timings;
+        for(int i = 0; s_stages[i]; i++)
+            if (record.timings.contains( s_stages[i] ))
+                timings[ s_stages[i] ] = record.timings[s_stages[i]];
+        timings["total"] = record.total;
+        object["ms"] = timings;
+
+        objects << object;
+    }
+    return Json::serialize( objects ) + "\n";
+}
+
+QDataStream& operator<<( QDataStream& out, const BatchCounter::Record& record )
+{
+    return out << record.path << record.ok << record.cached << record.counts << record.timings << (qint32)record.total
+               << (qint32)record.tiles << (qint32)record.reusedTiles;
+}
+
+QDataStream& operator>>( QDataStream& in, BatchCounter::Record& record )
+{
+    qint32 total, tiles, reusedTiles;
+    in >> record.path >> record.ok >> record.cached >> record.counts >> record.timings >> total
+       >> tiles >> reusedTiles;
+    record.total = total;
+    record.tiles = tiles;
+    record.reusedTiles = reusedTiles;
+    return in;
+}
@@ -0,0 +1,85 @@
+#ifndef BATCHCOUNTER_HPP
+#define BATCHCOUNTER_HPP
+
+#include <QtCore>
+
+#include "CountingEngine.hpp"
+
+namespace QArtm { class CacheArchive; }
+typedef QSharedPointer< QArtm::CacheArchive > CacheArchivePtr;
+typedef QSharedPointer< const QArtm::CountingEngine > CountingEnginePtr;
+
+// Counts every photo of an event directory without the gui, to audit what
+// was counted live. Photos are counted in parallel with the directory's
+// cache archive, the same one the gui uses, so whatever either of them
+// computed is reused by the other.
+class BatchCounter
+{
+public:
+    struct Options {
+        QString directory;
+        // where palette.png and flann.dat are, the directory itself by default
+        QString paletteDirectory;
+        QArtm::CountingEngine::Parameters parameters;
+        int jobs;
+        // worker processes decoding and classifying, 0 to do it all in this one
+        int processes;
+        bool json;
+        // count the originals tile by tile instead of at sizeLimit, not cached
+        bool fullResolution;
+        Options() : jobs( QThread::idealThreadCount() ), processes(0), json(false), fullResolution(false) {}
+    };
+
+    struct Record {
+        QString path;
+        bool ok;
+        // the classification came from the cache archive
+        bool cached;
+        QVector<int> counts;
+        QMap< QString, int > timings;
+        int total;
+        // tiles classified, and those copied from a previous photo's classification
+        int tiles, reusedTiles;
+        Record() : ok(false), cached(false), total(0), tiles(0), reusedTiles(0) {}
+    };
+
+    explicit BatchCounter(const Options& options);
+
+    // false if the directory can't be counted at all, see error()
+    bool run();
+    QString error() const { return m_error; }
+    const QList< Record >& records() const { return m_records; }
+
+    QByteArray csv() const;
+    QByteArray json() const;
+
+protected:
+    // counts one photo, runs on the global thread pool
+    struct CountPhoto {
+        typedef Record result_type;
+        CountingEnginePtr engine;
+        CacheArchivePtr archive;
+        QArtm::CountingEngine::Parameters parameters;
+        // photos that aren't classified yet are left to the workers
+        bool cachedOnly;
+        bool fullResolution;
+        CountPhoto() : cachedOnly(false), fullResolution(false) {}
+        Record operator()(const QString& path) const;
+    };
+
+    static const char * s_stages[];
+
+    Options m_options;
+    QString m_error;
+    QList< Record > m_records;
+};
+
+// a photo at its full resolution, see QArtm::TiledCounter
+BatchCounter::Record countFullResolution(const QArtm::CountingEngine& engine, const QString& path,
+                                         const QArtm::CountingEngine::Parameters& parameters);
+
+// records travel between worker processes and their supervisor
+QDataStream& operator<<( QDataStream& out, const BatchCounter::Record& record );
+QDataStream& operator>>( QDataStream& in, BatchCounter::Record& record );
+
+#endif // BATCHCOUNTER_HPP
@@ -0,0 +1,85 @@
+#include "static.h"
+
+#include "CountingWorker.hpp"
+#include "WorkerPool.hpp"
+
+CountingWorker::CountingWorker(const BatchCounter::Options &options, const QString &serverName,
+                               int slot, QObject *parent) :
+    QObject(parent),
+    m_options(options),
+    m_serverName(serverName),
+    m_slot(slot),
+    m_socket(new QLocalSocket(this)),
+    m_engine(new QArtm::CountingEngine)
+{
+    connect(m_socket, SIGNAL(readyRead()), SLOT(readJobs()));
+    connect(m_socket, SIGNAL(disconnected()), QCoreApplication::instance(), SLOT(quit()));
+}
+
+bool CountingWorker::start()
+{
+    if (!m_engine->load( QDir(m_options.paletteDirectory) )) {
+        qWarning() << "Worker" << m_slot << "has no palette in" << m_options.paletteDirectory;
+        return false;
+    }
+
+    m_socket->connectToServer(m_serverName);
+    if (!m_socket->waitForConnected(5000)) {
+        qWarning() << "Worker" << m_slot << "can't connect" << m_socket->errorString();
+        return false;
+    }
+
+    QByteArray hello;
+    QDataStream out(&hello, QIODevice::WriteOnly);
+    out << m_slot;
+    WorkerPool::writeFrame(m_socket, hello);
+    return true;
+}
+
+void CountingWorker::readJobs()
+{
+    QByteArray frame;
+    while (WorkerPool::readFrame(m_socket, frame)) {
+        int job;
+        QString path;
+        QDataStream in(frame);
+        in >> job >> path;
+
+        if (m_options.fullResolution) {
+            QByteArray reply;
+            QDataStream out(&reply, QIODevice::WriteOnly);
+            out << job << countFullResolution( *m_engine, path, m_options.parameters )
+                << (quint32)0 << (quint32)0 << QByteArray() << QByteArray();
+            WorkerPool::writeFrame(m_socket, reply);
+            m_socket->flush();
+            continue;
+        }
+
+        BatchCounter::Record record;
+        record.path = path;
+        QTime time;
+        time.start();
+        QArtm::CountingEngine::Result result =
+                m_engine->count( CacheArchivePtr(), path, m_options.parameters );
+        record.total = time.elapsed();
+
+        cv::Mat classes, distances;
+        record.ok = !result.indices.empty();
+        if (record.ok) {
+            record.counts = result.counts();
+            record.timings = result.timings;
+            QArtm::CountingEngine::quantize( result.indices, result.dists, classes, distances );
+        } else {
+            qWarning() << "Can't count" << qPrintable(path);
+        }
+
+        // matrices come out of convertTo continuous
+        QByteArray reply;
+        QDataStream out(&reply, QIODevice::WriteOnly);
+        out << job << record << (quint32)classes.rows << (quint32)classes.cols
+            << QByteArray::fromRawData( (const char *)classes.data, classes.total() * classes.elemSize() )
+            << QByteArray::fromRawData( (const char *)distances.data, distances.total() * distances.elemSize() );
+        WorkerPool::writeFrame(m_socket, reply);
+        m_socket->flush();
+    }
+}
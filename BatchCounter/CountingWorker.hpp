@@ -0,0 +1,33 @@
+#ifndef COUNTINGWORKER_HPP
+#define COUNTINGWORKER_HPP
+
+#include <QtCore>
+#include <QtNetwork>
+
+#include "BatchCounter.hpp"
+
+// The worker process end of WorkerPool: counts the photos it's sent one at
+// a time and sends back the record and the quantized classification. It
+// has no cache archive of its own and quits when the supervisor hangs up.
+class CountingWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CountingWorker(const BatchCounter::Options& options, const QString& serverName,
+                            int slot, QObject *parent = 0);
+
+    // false if there's no palette or no supervisor to work for
+    bool start();
+
+protected slots:
+    void readJobs();
+
+protected:
+    BatchCounter::Options m_options;
+    QString m_serverName;
+    int m_slot;
+    QLocalSocket * m_socket;
+    QSharedPointer< QArtm::CountingEngine > m_engine;
+};
+
+#endif // COUNTINGWORKER_HPP
@@ -0,0 +1,264 @@
+#include "static.h"
+
+#include "WorkerPool.hpp"
+#include "CacheArchive.hpp"
+
+WorkerPool::WorkerPool(const BatchCounter::Options &options, CacheArchivePtr archive,
+                       quint64 classificationKey, QObject *parent) :
+    QObject(parent),
+    m_options(options),
+    m_archive(archive),
+    m_classificationKey(classificationKey),
+    m_server(new QLocalServer(this)),
+    m_remaining(0)
+{
+    connect(m_server, SIGNAL(newConnection()), SLOT(workerConnected()));
+}
+
+WorkerPool::~WorkerPool()
+{
+    // workers quit when their socket goes
+    for(int slot = 0; slot < m_workers.size(); slot++) {
+        Worker& worker = m_workers[slot];
+        if (worker.socket) {
+            worker.socket->disconnect(this);
+            worker.socket->disconnectFromServer();
+        }
+        if (worker.process) {
+            worker.process->disconnect(this);
+            worker.process->waitForFinished(1000);
+        }
+    }
+}
+
+QList< BatchCounter::Record > WorkerPool::run(const QStringList &paths)
+{
+    m_paths = paths;
+    m_records = QVector< BatchCounter::Record >( paths.size() );
+    m_attempts = QVector< int >( paths.size(), 0 );
+    m_queue.clear();
+    for(int i = 0; i < paths.size(); i++) {
+        m_records[i].path = paths[i];
+        m_queue << i;
+    }
+    m_remaining = paths.size();
+    if (!m_remaining)
+        return m_records.toList();
+
+    QString name = QString("BatchCounter-%1").arg( QCoreApplication::applicationPid() );
+    QLocalServer::removeServer(name);
+    if (!m_server->listen(name)) {
+        qWarning() << "Can't listen for workers" << m_server->errorString();
+        return m_records.toList();
+    }
+
+    m_workers = QVector< Worker >( qMin( m_options.processes, paths.size() ) );
+    for(int slot = 0; slot < m_workers.size(); slot++)
+        spawn(slot);
+
+    QEventLoop loop;
+    connect(this, SIGNAL(finished()), &loop, SLOT(quit()));
+    loop.exec();
+
+    m_server->close();
+    return m_records.toList();
+}
+
+void WorkerPool::spawn(int slot)
+{
+    Worker& worker = m_workers[slot];
+    worker.process = new QProcess(this);
+    worker.process->setProperty("slot", slot);
+    worker.process->setProcessChannelMode(QProcess::ForwardedChannels);
+    connect(worker.process, SIGNAL(finished(int,QProcess::ExitStatus)), SLOT(workerLost()));
+    connect(worker.process, SIGNAL(error(QProcess::ProcessError)), SLOT(workerLost()));
+
+    const QArtm::CountingEngine::Parameters& params = m_options.parameters;
+    QStringList args;
+    args << "--worker" << m_server->serverName()
+         << "--slot" << QString::number(slot)
+         << "--palette" << m_options.paletteDirectory
+         << "--threshold" << QString::number(params.threshold)
+         << "--size-filter" << QString::number(params.sizeFilter)
+         << "--size-limit" << QString::number(params.sizeLimit);
+    if (m_options.fullResolution)
+        args << "--full-resolution";
+    args << m_options.directory;
+    worker.process->start( QCoreApplication::applicationFilePath(), args );
+}
+
+// the first frame of a worker is its slot
+void WorkerPool::workerConnected()
+{
+    while (m_server->hasPendingConnections()) {
+        QLocalSocket * socket = m_server->nextPendingConnection();
+        connect(socket, SIGNAL(readyRead()), SLOT(workerReadyRead()));
+        connect(socket, SIGNAL(disconnected()), SLOT(workerLost()));
+        // it may have said hello already
+        readWorker(socket);
+    }
+}
+
+void WorkerPool::workerReadyRead()
+{
+    QLocalSocket * socket = qobject_cast< QLocalSocket * >( sender() );
+    if (socket)
+        readWorker(socket);
+}
+
+void WorkerPool::readWorker(QLocalSocket *socket)
+{
+    QByteArray frame;
+    while (readFrame(socket, frame)) {
+        QDataStream in(frame);
+        int slot = slotOf(socket);
+        if (slot < 0) {
+            in >> slot;
+            if (slot < 0 || slot >= m_workers.size() || m_workers[slot].socket) {
+                socket->abort();
+                return;
+            }
+            socket->setProperty("slot", slot);
+            m_workers[slot].socket = socket;
+            m_workers[slot].startFailures = 0;
+            feed(slot);
+            continue;
+        }
+
+        int job;
+        BatchCounter::Record record;
+        cv::Mat classes, distances;
+        in >> job >> record;
+        quint32 rows, cols;
+        QByteArray classesData, distancesData;
+        in >> rows >> cols >> classesData >> distancesData;
+        if (in.status() != QDataStream::Ok || !m_workers[slot].inFlight.removeOne(job))
+            continue;
+
+        // the worker has no archive, its classification is cached here;
+        // full resolution counts come without one
+        if (record.ok && rows && cols && classesData.size() == (int)(rows * cols)
+                && distancesData.size() == (int)(rows * cols * sizeof(quint16))) {
+            classes = cv::Mat( rows, cols, CV_8UC1, classesData.data() );
+            distances = cv::Mat( rows, cols, CV_16UC1, distancesData.data() );
+            QByteArray hash = m_archive->contentHash( m_paths[job] );
+            QArtm::CountingEngine::saveQuantized( m_archive, hash, classes, distances, m_classificationKey );
+        }
+        record.path = m_paths[job];
+        finish(job, record);
+        feed(slot);
+    }
+}
+
+// a worker crashed, quit or never started: whatever it had is tried again
+void WorkerPool::workerLost()
+{
+    int slot = slotOf(sender());
+    if (slot < 0 || slot >= m_workers.size()) {
+        // hung up before saying which worker it is, its process tells
+        if (qobject_cast< QLocalSocket * >( sender() ))
+            sender()->deleteLater();
+        return;
+    }
+    Worker& worker = m_workers[slot];
+    if (!worker.process && !worker.socket)
+        return;
+
+    if (!worker.socket)
+        worker.startFailures++;
+    foreach(int job, worker.inFlight) {
+        if (++m_attempts[job] < MAX_ATTEMPTS) {
+            m_queue.prepend(job);
+        } else {
+            qWarning() << "Giving up on" << qPrintable(m_paths[job]) << "after it took down"
+                       << m_attempts[job] << "workers";
+            BatchCounter::Record record;
+            record.path = m_paths[job];
+            finish(job, record);
+        }
+    }
+    worker.inFlight.clear();
+
+    if (worker.socket) {
+        worker.socket->disconnect(this);
+        worker.socket->abort();
+        worker.socket->deleteLater();
+        worker.socket = 0;
+    }
+    if (worker.process) {
+        worker.process->disconnect(this);
+        if (worker.process->state() != QProcess::NotRunning)
+            worker.process->kill();
+        worker.process->deleteLater();
+        worker.process = 0;
+    }
+    for(int i = 0; i < m_workers.size(); i++)
+        feed(i);
+
+    if (!m_remaining)
+        return;
+    if (worker.startFailures < MAX_START_FAILURES) {
+        qDebug() << "Restarting worker" << slot;
+        spawn(slot);
+        return;
+    }
+
+    qWarning() << "Worker" << slot << "doesn't start";
+    for(int i = 0; i < m_workers.size(); i++)
+        if (m_workers[i].process)
+            return;
+    // no worker left, what's queued can't be counted
+    foreach(int job, m_queue) {
+        BatchCounter::Record record;
+        record.path = m_paths[job];
+        finish(job, record);
+    }
+    m_queue.clear();
+}
+
+void WorkerPool::feed(int slot)
+{
+    Worker& worker = m_workers[slot];
+    while (worker.socket && worker.inFlight.size() < WINDOW && !m_queue.isEmpty()) {
+        int job = m_queue.takeFirst();
+        QByteArray frame;
+        QDataStream out(&frame, QIODevice::WriteOnly);
+        out << job << m_paths[job];
+        writeFrame(worker.socket, frame);
+        worker.inFlight << job;
+    }
+}
+
+void WorkerPool::finish(int job, const BatchCounter::Record &record)
+{
+    m_records[job] = record;
+    if (--m_remaining == 0)
+        emit finished();
+}
+
+int WorkerPool::slotOf(QObject *object) const
+{
+    QVariant slot = object ? object->property("slot") : QVariant();
+    return slot.isValid() ? slot.toInt() : -1;
+}
+
+void WorkerPool::writeFrame(QIODevice *device, const QByteArray &frame)
+{
+    QDataStream out(device);
+    out << (quint32)frame.size();
+    device->write(frame);
+}
+
+bool WorkerPool::readFrame(QIODevice *device, QByteArray &frame)
+{
+    quint32 size;
+    if (device->bytesAvailable() < (qint64)sizeof(size))
+        return false;
+    device->peek( (char *)&size, sizeof(size) );
+    size = qFromBigEndian(size);
+    if (device->bytesAvailable() < (qint64)(sizeof(size) + size))
+        return false;
+    device->read( sizeof(size) );
+    frame = device->read( size );
+    return true;
+}
@@ -0,0 +1,77 @@
+#ifndef WORKERPOOL_HPP
+#define WORKERPOOL_HPP
+
+#include <QtCore>
+#include <QtNetwork>
+
+#include "BatchCounter.hpp"
+
+// Supervises worker processes that decode and classify photos, each its
+// own copy of this executable started with --worker, so one corrupt JPEG
+// only takes down its worker and each worker's memory is its own.
+//
+// Workers connect back over a local socket and get jobs streamed to them,
+// at most WINDOW outstanding each so the slow ones don't hoard the queue.
+// A worker that dies is restarted and its outstanding photos are tried
+// again, up to MAX_ATTEMPTS times before they are given up on.
+//
+// Only the supervisor touches the cache archive: workers send back the
+// quantized classification and it's stored here.
+class WorkerPool : public QObject
+{
+    Q_OBJECT
+public:
+    static const int WINDOW = 2;
+    static const int MAX_ATTEMPTS = 2;
+    // a worker slot that fails to start this many times in a row is given up
+    static const int MAX_START_FAILURES = 3;
+
+    explicit WorkerPool(const BatchCounter::Options& options, CacheArchivePtr archive,
+                        quint64 classificationKey, QObject *parent = 0);
+    ~WorkerPool();
+
+    // counts the photos in the workers, returns once all are done;
+    // the records are in the order of paths
+    QList< BatchCounter::Record > run(const QStringList& paths);
+
+    // length prefixed frames, both ends of the socket use them
+    static void writeFrame(QIODevice * device, const QByteArray& frame);
+    static bool readFrame(QIODevice * device, QByteArray& frame);
+
+signals:
+    void finished();
+
+protected slots:
+    void workerConnected();
+    void workerReadyRead();
+    void workerLost();
+
+protected:
+    struct Worker {
+        QProcess * process;
+        QLocalSocket * socket;
+        QList<int> inFlight;
+        int startFailures;
+        Worker() : process(0), socket(0), startFailures(0) {}
+    };
+
+    BatchCounter::Options m_options;
+    CacheArchivePtr m_archive;
+    quint64 m_classificationKey;
+    QLocalServer * m_server;
+    QVector< Worker > m_workers;
+
+    QStringList m_paths;
+    QVector< BatchCounter::Record > m_records;
+    QVector< int > m_attempts;
+    QList< int > m_queue;
+    int m_remaining;
+
+    void spawn(int slot);
+    void readWorker(QLocalSocket * socket);
+    void feed(int slot);
+    void finish(int job, const BatchCounter::Record& record);
+    int slotOf(QObject * object) const;
+};
+
+#endif // WORKERPOOL_HPP
@@ -0,0 +1,104 @@
+#include "static.h"
+
+#include "BatchCounter.hpp"
+#include "CountingWorker.hpp"
+
+static void usage()
+{
+    QTextStream err(stderr);
+    err << "usage: BatchCounter [options] <snapshot directory>\n"
+           "  --palette <dir>       where palette.png and flann.dat are, the snapshot directory by default\n"
+           "  --threshold <n>       colorDiffThreshold, 10 by default\n"
+           "  --size-filter <n>     sizeFilter, 10 by default\n"
+           "  --size-limit <n>      sizeLimit, 1024 by default\n"
+           "  --jobs <n>            photos counted at once, one per core by default\n"
+           "  --processes <n>       decode and classify in n worker processes, crashes only lose the photo\n"
+           "  --full-resolution     count the originals in tiles instead of at the size limit\n"
+           "  --json                JSON instead of CSV\n"
+           "  --output <file>       instead of the standard output\n";
+}
+
+int
+main(int argc, char * argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("Batch Counter");
+
+    BatchCounter::Options options;
+    QString output;
+    // set in the worker processes WorkerPool starts
+    QString workerServer;
+    int workerSlot = -1;
+    QStringList args = app.arguments().mid(1);
+    bool ok = true;
+    while (ok && !args.isEmpty()) {
+        QString arg = args.takeFirst();
+        if (arg == "--json") {
+            options.json = true;
+        } else if (arg == "--full-resolution") {
+            options.fullResolution = true;
+        } else if (arg.startsWith("--")) {
+            if (args.isEmpty()) {
+                ok = false;
+                break;
+            }
+            QString value = args.takeFirst();
+            if (arg == "--palette")
+                options.paletteDirectory = value;
+            else if (arg == "--threshold")
+                options.parameters.threshold = value.toInt(&ok);
+            else if (arg == "--size-filter")
+                options.parameters.sizeFilter = value.toInt(&ok);
+            else if (arg == "--size-limit")
+                options.parameters.sizeLimit = value.toInt(&ok);
+            else if (arg == "--jobs")
+                options.jobs = value.toInt(&ok);
+            else if (arg == "--processes")
+                options.processes = value.toInt(&ok);
+            else if (arg == "--output")
+                output = value;
+            else if (arg == "--worker")
+                workerServer = value;
+            else if (arg == "--slot")
+                workerSlot = value.toInt(&ok);
+            else
+                ok = false;
+        } else if (options.directory.isEmpty()) {
+            options.directory = arg;
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok || options.directory.isEmpty()) {
+        usage();
+        return 1;
+    }
+
+    if (!workerServer.isEmpty()) {
+        if (options.paletteDirectory.isEmpty())
+            options.paletteDirectory = options.directory;
+        CountingWorker worker(options, workerServer, workerSlot);
+        if (!worker.start())
+            return 1;
+        return app.exec();
+    }
+
+    BatchCounter counter(options);
+    if (!counter.run()) {
+        qWarning() << qPrintable(counter.error());
+        return 1;
+    }
+
+    QFile out;
+    if (output.isEmpty()) {
+        out.open(stdout, QIODevice::WriteOnly);
+    } else {
+        out.setFileName(output);
+        if (!out.open(QIODevice::WriteOnly)) {
+            qWarning() << "Can't write" << output << out.errorString();
+            return 1;
+        }
+    }
+    out.write( options.json ? counter.json() : counter.csv() );
+    return 0;
+}
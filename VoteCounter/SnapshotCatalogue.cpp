@@ -0,0 +1,365 @@
+#include "static.h"
+
+#include "SnapshotCatalogue.hpp"
+#include "Exif.hpp"
+#include "ImageLoader.hpp"
+
+QStringList SnapshotCatalogue::s_nameFilters = QStringList() << "*.jpg" << "*.JPG";
+
+QDataStream& operator<<(QDataStream& out, const SnapshotRecord& record)
+{
+    return out << record.name << record.size << record.modified << record.captured
+               << record.cacheState << record.counts;
+}
+
+QDataStream& operator>>(QDataStream& in, SnapshotRecord& record)
+{
+    return in >> record.name >> record.size >> record.modified >> record.captured
+              >> record.cacheState >> record.counts;
+}
+
+// Makes a thumbnail off the gui thread, the catalogue stores it in the atlas
+class ThumbnailJob : public QRunnable
+{
+public:
+    ThumbnailJob(SnapshotCatalogue * catalogue, const QString& path, const QSize& size) :
+        m_catalogue(catalogue), m_path(path), m_size(size)
+    {}
+
+    void run()
+    {
+        // don't compete with counting
+        QThread::currentThread()->setPriority( QThread::LowestPriority );
+        QImage thumbnail = QArtm::ImageLoader::preview( m_path )
+                .scaled( m_size, Qt::KeepAspectRatio, Qt::SmoothTransformation );
+        QMetaObject::invokeMethod( m_catalogue, "storeThumbnail", Qt::QueuedConnection,
+                                   Q_ARG(QString, m_path), Q_ARG(QImage, thumbnail) );
+    }
+
+protected:
+    SnapshotCatalogue * m_catalogue;
+    QString m_path;
+    QSize m_size;
+};
+
+static bool newerFirst(const SnapshotRecord& a, const SnapshotRecord& b)
+{
+    if (a.time() != b.time())
+        return a.time() > b.time();
+    return a.name > b.name;
+}
+
+SnapshotCatalogue::SnapshotCatalogue(QObject *parent) :
+    QAbstractListModel(parent),
+    m_watcher(new QFileSystemWatcher(this)),
+    m_rescanTimer(new QTimer(this)),
+    m_saveTimer(new QTimer(this)),
+    m_atlas(QSize(96, 72)),
+    m_thumbnailsInFlight(0)
+{
+    m_thumbnailPool.setMaxThreadCount( qMax(1, QThread::idealThreadCount() - 1) );
+
+    m_watcher->setObjectName("watcher");
+    QMetaObject::connectSlotsByName(this);
+
+    // photos arrive in bursts, catch up with them all at once
+    m_rescanTimer->setSingleShot(true);
+    m_rescanTimer->setInterval(200);
+    connect(m_rescanTimer, SIGNAL(timeout()), SLOT(rescan()));
+
+    m_saveTimer->setSingleShot(true);
+    m_saveTimer->setInterval(2000);
+    connect(m_saveTimer, SIGNAL(timeout()), SLOT(save()));
+}
+
+SnapshotCatalogue::~SnapshotCatalogue()
+{
+    // jobs post back to us, don't let them outlive the catalogue
+    m_thumbnailQueue.clear();
+    m_thumbnailPool.waitForDone();
+
+    if (m_saveTimer->isActive())
+        save();
+}
+
+void SnapshotCatalogue::setDirectory(const QString &path)
+{
+    if (m_saveTimer->isActive())
+        save();
+    if (!m_watcher->directories().isEmpty())
+        m_watcher->removePaths( m_watcher->directories() );
+
+    if (path.isEmpty())
+        return;
+    QDir dir(path);
+    m_thumbnailQueue.clear();
+
+    // the directory may have changed while we weren't looking,
+    // so verify what's been loaded against the files once
+    QList< SnapshotRecord > loaded = load(dir);
+    QHash< QString, int > loadedRows;
+    for(int r = 0; r < loaded.size(); r++)
+        loadedRows[ loaded[r].name ] = r;
+    QList< SnapshotRecord > records;
+    foreach(QFileInfo fi, dir.entryInfoList( s_nameFilters, QDir::Files, QDir::Unsorted )) {
+        int r = loadedRows.value( fi.fileName(), -1 );
+        if (r >= 0 && loaded[r].size == fi.size() && loaded[r].modified == fi.lastModified())
+            records << loaded[r];
+        else
+            records << readRecord(fi);
+    }
+    qSort(records.begin(), records.end(), newerFirst);
+
+    // views see the old directory until the reset
+    beginResetModel();
+    m_dir = dir;
+    m_atlas.open( m_dir.filePath("thumbnails.atlas") );
+    m_records = records;
+    reindex();
+    endResetModel();
+
+    foreach(const SnapshotRecord& record, m_records)
+        queueThumbnail(record);
+    startThumbnails();
+
+    qDebug() << "Catalogue of" << qPrintable(path) << "has" << m_records.size() << "snapshots";
+
+    m_watcher->addPath(path);
+    m_saveTimer->start();
+    emit updated();
+}
+
+void SnapshotCatalogue::on_watcher_directoryChanged(const QString &)
+{
+    m_rescanTimer->start();
+}
+
+void SnapshotCatalogue::rescan()
+{
+    QHash< QString, QFileInfo > present;
+    foreach(QFileInfo fi, m_dir.entryInfoList( s_nameFilters, QDir::Files, QDir::Unsorted ))
+        present.insert( fi.fileName(), fi );
+
+    // drop the deleted ones, and the ones written over since they were
+    // read: their counts and thumbnail are those of another photo
+    int removed = m_records.size();
+    for(int r = m_records.size() - 1; r >= 0; r--) {
+        QHash< QString, QFileInfo >::iterator fi = present.find( m_records[r].name );
+        if (fi != present.end() && fi->size() == m_records[r].size
+                && fi->lastModified() == m_records[r].modified) {
+            present.erase(fi);
+            continue;
+        }
+        m_rows.remove( m_records[r].name );
+        beginRemoveRows(QModelIndex(), r, r);
+        m_records.removeAt(r);
+        endRemoveRows();
+        removed = r;
+    }
+    reindex(removed);
+
+    // whatever is left is new or written over, only these get their EXIF
+    // read, and they are thumbnailed and ingested again
+    QList< SnapshotRecord > arrivals;
+    foreach(const QFileInfo& fi, present) {
+        SnapshotRecord record = readRecord(fi);
+        insertRecord( record );
+        // newcomers jump the queue
+        int queued = m_thumbnailQueue.size();
+        queueThumbnail( record );
+        if (m_thumbnailQueue.size() > queued)
+            m_thumbnailQueue.move( queued, 0 );
+        arrivals << record;
+    }
+    startThumbnails();
+
+    m_saveTimer->start();
+    if (!arrivals.isEmpty()) {
+        qSort( arrivals.begin(), arrivals.end(), newerFirst );
+        QStringList paths;
+        foreach(const SnapshotRecord& record, arrivals)
+            paths.prepend( m_dir.filePath(record.name) );
+        emit arrived(paths);
+    }
+    emit updated();
+}
+
+SnapshotRecord SnapshotCatalogue::readRecord(const QFileInfo &fi) const
+{
+    SnapshotRecord record;
+    record.name = fi.fileName();
+    record.size = fi.size();
+    record.modified = fi.lastModified();
+    record.captured = QArtm::Exif( fi.filePath() ).dateTimeOriginal();
+    return record;
+}
+
+void SnapshotCatalogue::insertRecord(const SnapshotRecord &record)
+{
+    int r = qLowerBound( m_records.begin(), m_records.end(), record, newerFirst ) - m_records.begin();
+    beginInsertRows(QModelIndex(), r, r);
+    m_records.insert(r, record);
+    reindex(r);
+    endInsertRows();
+}
+
+void SnapshotCatalogue::reindex(int from)
+{
+    if (from == 0)
+        m_rows.clear();
+    for(int r = from; r < m_records.size(); r++)
+        m_rows[ m_records[r].name ] = r;
+}
+
+void SnapshotCatalogue::queueThumbnail(const SnapshotRecord &record)
+{
+    if (!m_atlas.contains( record.thumbnailKey() ))
+        m_thumbnailQueue << m_dir.filePath( record.name );
+}
+
+// only as many jobs as there are workers are handed to the pool, the rest
+// wait in our queue so that switching directories can drop them
+void SnapshotCatalogue::startThumbnails()
+{
+    while (!m_thumbnailQueue.isEmpty() && m_thumbnailsInFlight < m_thumbnailPool.maxThreadCount()) {
+        m_thumbnailPool.start( new ThumbnailJob( this, m_thumbnailQueue.takeFirst(), m_atlas.cellSize() ) );
+        m_thumbnailsInFlight++;
+    }
+}
+
+void SnapshotCatalogue::storeThumbnail(const QString &path, const QImage &thumbnail)
+{
+    m_thumbnailsInFlight--;
+    startThumbnails();
+
+    QFileInfo fi(path);
+    int r = row( fi.fileName() );
+    if (r < 0 || fi.absoluteDir() != QDir(m_dir.absolutePath()) || thumbnail.isNull())
+        return;
+
+    m_atlas.store( m_records[r].thumbnailKey(), thumbnail );
+    emit dataChanged( index(r), index(r) );
+}
+
+QList< SnapshotRecord > SnapshotCatalogue::load(const QDir &dir) const
+{
+    QList< SnapshotRecord > records;
+    QFile file( dir.filePath("catalogue.dat") );
+    if (!file.open(QIODevice::ReadOnly))
+        return records;
+
+    QDataStream in(&file);
+    quint32 magic, version;
+    in >> magic >> version;
+    if (magic != s_magic || version != s_version) {
+        qDebug() << "Ignoring incompatible catalogue" << file.fileName();
+        return records;
+    }
+    in >> records;
+    if (in.status() != QDataStream::Ok)
+        records.clear();
+    return records;
+}
+
+void SnapshotCatalogue::save()
+{
+    m_saveTimer->stop();
+
+    // write aside and swap, so a crash never leaves a truncated catalogue
+    QString path = m_dir.filePath("catalogue.dat");
+    QFile file( path + ".tmp" );
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Can't save catalogue" << file.fileName();
+        return;
+    }
+    QDataStream out(&file);
+    out << s_magic << s_version << m_records;
+    file.close();
+
+    QFile::remove(path);
+    file.rename(path);
+}
+
+int SnapshotCatalogue::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : m_records.size();
+}
+
+QVariant SnapshotCatalogue::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_records.size())
+        return QVariant();
+
+    const SnapshotRecord& record = m_records[index.row()];
+    switch(role) {
+    case Qt::DisplayRole:
+        return record.name;
+    case Qt::DecorationRole:
+        return m_atlas.image( record.thumbnailKey() );
+    case Qt::ToolTipRole: {
+        QString tip = record.time().toString( Qt::SystemLocaleShortDate );
+        if (!record.previousCounts.isEmpty()) {
+            QStringList previous;
+            foreach(int count, record.previousCounts)
+                previous << QString::number(count);
+            tip += QString("\nwas %1 before the recount").arg( previous.join(" / ") );
+        }
+        return tip;
+    }
+    case PathRole:
+        return m_dir.filePath( record.name );
+    case CapturedRole:
+        return record.time();
+    case CountsRole: {
+        QVariantList counts;
+        if (record.cacheState & SnapshotRecord::COUNTED)
+            foreach(int count, record.counts)
+                counts << count;
+        return counts;
+    }
+    case CacheStateRole:
+        return record.cacheState;
+    case PreviousCountsRole: {
+        QVariantList counts;
+        foreach(int count, record.previousCounts)
+            counts << count;
+        return counts;
+    }
+    }
+    return QVariant();
+}
+
+int SnapshotCatalogue::row(const QString &name) const
+{
+    return m_rows.value(name, -1);
+}
+
+void SnapshotCatalogue::setCounts(const QString &name, const QVector<int> &counts, bool recounted)
+{
+    int r = row(name);
+    if (r < 0)
+        return;
+    SnapshotRecord& record = m_records[r];
+    if (recounted && (record.cacheState & SnapshotRecord::COUNTED) && record.counts != counts)
+        record.previousCounts = record.counts;
+    else if (record.counts != counts)
+        record.previousCounts.clear();
+    m_records[r].counts = counts;
+    m_records[r].cacheState |= SnapshotRecord::COUNTED;
+    recordChanged(r);
+}
+
+void SnapshotCatalogue::addCacheState(const QString &name, int flags)
+{
+    int r = row(name);
+    if (r < 0 || (m_records[r].cacheState & flags) == flags)
+        return;
+    m_records[r].cacheState |= flags;
+    recordChanged(r);
+}
+
+void SnapshotCatalogue::recordChanged(int row)
+{
+    emit dataChanged( index(row), index(row) );
+    m_saveTimer->start();
+}
@@ -0,0 +1,107 @@
+#ifndef SNAPSHOTCATALOGUE_HPP
+#define SNAPSHOTCATALOGUE_HPP
+
+#include <QtCore>
+#include <QtGui>
+
+#include "ThumbnailAtlas.hpp"
+
+// What we know about a snapshot without opening it
+struct SnapshotRecord {
+    enum CacheState {
+        NOT_CACHED = 0,
+        CACHED = 1,     // opened or ingested, so the archive has its input
+        COUNTED = 2     // counts below are valid
+    };
+
+    QString name;
+    qint64 size;
+    QDateTime modified;
+    QDateTime captured;
+    int cacheState;
+    QVector<int> counts;
+    // what the counts were before a recount changed them, not saved
+    QVector<int> previousCounts;
+
+    SnapshotRecord() : size(0), cacheState(NOT_CACHED) {}
+    // EXIF capture time if the camera wrote one, file time otherwise
+    QDateTime time() const { return captured.isValid() ? captured : modified; }
+    quint64 thumbnailKey() const { return QArtm::ThumbnailAtlas::key(name, size, modified); }
+};
+
+QDataStream& operator<<(QDataStream& out, const SnapshotRecord& record);
+QDataStream& operator>>(QDataStream& in, SnapshotRecord& record);
+
+// Persistent list of the snapshots in the snaps directory, newest first.
+// It's updated incrementally from the file system notifications and
+// doubles as the model behind the snapsList. Thumbnails are made by a low
+// priority worker pool and kept in the directory's thumbnail atlas.
+class SnapshotCatalogue : public QAbstractListModel
+{
+    Q_OBJECT
+public:
+    enum Roles {
+        PathRole = Qt::UserRole,
+        CapturedRole,
+        CountsRole,
+        CacheStateRole,
+        PreviousCountsRole
+    };
+
+    explicit SnapshotCatalogue(QObject *parent = 0);
+    ~SnapshotCatalogue();
+
+    void setDirectory(const QString& path);
+    QDir directory() const { return m_dir; }
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const;
+    QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const;
+
+    int row(const QString& name) const;
+    const SnapshotRecord& record(int row) const { return m_records[row]; }
+
+    // recounted keeps the counts it replaces if they differ
+    void setCounts(const QString& name, const QVector<int>& counts, bool recounted = false);
+    void addCacheState(const QString& name, int flags);
+
+signals:
+    void updated();
+    // new files seen by the watcher, oldest first
+    void arrived(const QStringList& paths);
+
+public slots:
+    void rescan();
+    void save();
+
+protected slots:
+    void on_watcher_directoryChanged(const QString& path);
+    void storeThumbnail(const QString& path, const QImage& thumbnail);
+
+protected:
+    static const quint32 s_magic = 0x56435343; // "VCSC"
+    static const quint32 s_version = 1;
+    static QStringList s_nameFilters;
+
+    QDir m_dir;
+    QList< SnapshotRecord > m_records;
+    // name to row, kept up to date as records come and go
+    QHash< QString, int > m_rows;
+    QFileSystemWatcher * m_watcher;
+    QTimer * m_rescanTimer;
+    QTimer * m_saveTimer;
+
+    QArtm::ThumbnailAtlas m_atlas;
+    QThreadPool m_thumbnailPool;
+    QStringList m_thumbnailQueue;
+    int m_thumbnailsInFlight;
+
+    QList< SnapshotRecord > load(const QDir& dir) const;
+    SnapshotRecord readRecord(const QFileInfo& fi) const;
+    void insertRecord(const SnapshotRecord& record);
+    void reindex(int from = 0);
+    void recordChanged(int row);
+    void queueThumbnail(const SnapshotRecord& record);
+    void startThumbnails();
+};
+
+#endif // SNAPSHOTCATALOGUE_HPP
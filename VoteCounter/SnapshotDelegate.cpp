@@ -0,0 +1,63 @@
+#include "static.h"
+
+#include "SnapshotDelegate.hpp"
+#include "SnapshotCatalogue.hpp"
+
+SnapshotDelegate::SnapshotDelegate(QObject *parent) :
+    QStyledItemDelegate(parent)
+{
+    // same order as SnapshotModel's colors: green, pink, yellow
+    m_countColors << QColor(100, 255, 100) << QColor(255, 120, 200) << QColor(255, 255, 80);
+}
+
+void SnapshotDelegate::paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const
+{
+    painter->save();
+
+    if (option.state & QStyle::State_Selected)
+        painter->fillRect( option.rect, option.palette.highlight() );
+
+    QRect thumbRect( option.rect.left() + MARGIN, option.rect.top() + MARGIN,
+                     THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT );
+    QImage thumbnail = index.data( Qt::DecorationRole ).value<QImage>();
+    if (thumbnail.isNull())
+        painter->fillRect( thumbRect, Qt::darkGray );
+    else
+        painter->drawImage( thumbRect, thumbnail );
+
+    // last known counts overlaid along the bottom of the thumbnail
+    QVariantList counts = index.data( SnapshotCatalogue::CountsRole ).toList();
+    // counts a recount changed are outlined
+    QVariantList previous = index.data( SnapshotCatalogue::PreviousCountsRole ).toList();
+    if (!counts.isEmpty()) {
+        QFont font = option.font;
+        font.setBold(true);
+        painter->setFont(font);
+        int w = thumbRect.width() / counts.size();
+        int h = option.fontMetrics.height();
+        for(int i = 0; i < counts.size(); i++) {
+            QRect r( thumbRect.left() + i * w, thumbRect.bottom() - h, w, h );
+            painter->fillRect( r, QColor(0, 0, 0, 160) );
+            painter->setPen( m_countColors.value(i, Qt::white) );
+            painter->drawText( r, Qt::AlignCenter, counts[i].toString() );
+            if (!previous.isEmpty() && previous.value(i) != counts[i])
+                painter->drawRect( r.adjusted(0, 0, -1, -1) );
+        }
+    }
+
+    QRect textRect( option.rect.left() + MARGIN, thumbRect.bottom() + 1,
+                    option.rect.width() - 2 * MARGIN, option.fontMetrics.height() );
+    painter->setFont( option.font );
+    painter->setPen( option.palette.color( (option.state & QStyle::State_Selected)
+                                           ? QPalette::HighlightedText : QPalette::Text ) );
+    painter->drawText( textRect, Qt::AlignCenter,
+                       option.fontMetrics.elidedText( index.data().toString(), Qt::ElideMiddle, textRect.width() ) );
+
+    painter->restore();
+}
+
+QSize SnapshotDelegate::sizeHint(const QStyleOptionViewItem &option, const QModelIndex &) const
+{
+    return QSize( THUMBNAIL_WIDTH + 2 * MARGIN,
+                  THUMBNAIL_HEIGHT + option.fontMetrics.height() + 2 * MARGIN );
+}
@@ -0,0 +1,26 @@
+#ifndef SNAPSHOTDELEGATE_HPP
+#define SNAPSHOTDELEGATE_HPP
+
+#include <QtCore>
+#include <QtGui>
+
+// Draws a snapsList entry: thumbnail from the atlas with the last known
+// counts on top of it and the file name below
+class SnapshotDelegate : public QStyledItemDelegate
+{
+    Q_OBJECT
+public:
+    explicit SnapshotDelegate(QObject *parent = 0);
+
+    virtual void paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const;
+    virtual QSize sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const;
+
+protected:
+    static const int THUMBNAIL_WIDTH = 96;
+    static const int THUMBNAIL_HEIGHT = 72;
+    static const int MARGIN = 2;
+
+    QList< QColor > m_countColors;
+};
+
+#endif // SNAPSHOTDELEGATE_HPP
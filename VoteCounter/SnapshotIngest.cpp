@@ -0,0 +1,230 @@
+#include "static.h"
+
+#include "SnapshotIngest.hpp"
+#include "CacheArchive.hpp"
+
+struct IngestJob : public QArtm::StageJob
+{
+    QString path;
+    int generation;
+    int sizeLimit, threshold, sizeFilter;
+    CacheArchivePtr archive;
+
+    QByteArray hash;
+    CountingEnginePtr engine;
+    cv::Mat input, fingerprints, lab, indices, dists;
+    QVector<cv::Mat> masks;
+    QVector<int> counts;
+};
+
+class DecodeStage : public QArtm::StageScheduler::Stage
+{
+public:
+    DecodeStage(SnapshotIngest * ingest) : m_ingest(ingest) {}
+    QString name() const { return "decode"; }
+
+    bool process(QArtm::StageJob * stageJob)
+    {
+        IngestJob * job = static_cast<IngestJob*>(stageJob);
+        job->hash = job->archive->contentHash( job->path );
+        job->engine = m_ingest->engine();
+
+        // classified already, by an earlier ingest or by opening it
+        if (job->engine) {
+            quint64 key = job->engine->classificationKey( job->sizeLimit );
+            if (QArtm::CountingEngine::loadClassification( job->archive, job->hash, key, job->indices, job->dists ))
+                return true;
+        }
+
+        job->input = QArtm::CountingEngine::loadInput( job->archive, job->hash, job->path, job->sizeLimit );
+        if (job->input.empty())
+            return false;
+        job->fingerprints = QArtm::CountingEngine::fingerprints( job->input );
+        return true;
+    }
+
+protected:
+    SnapshotIngest * m_ingest;
+};
+
+class LabStage : public QArtm::StageScheduler::Stage
+{
+public:
+    QString name() const { return "lab"; }
+
+    bool process(QArtm::StageJob * stageJob)
+    {
+        IngestJob * job = static_cast<IngestJob*>(stageJob);
+        if (!job->indices.empty())
+            return true;
+
+        job->lab = QArtm::CountingEngine::loadLab( job->archive, job->hash, job->input, job->sizeLimit );
+        job->input = cv::Mat();
+        return true;
+    }
+};
+
+class ClassifyStage : public QArtm::StageScheduler::Stage
+{
+public:
+    ClassifyStage(SnapshotIngest * ingest) : m_ingest(ingest) {}
+    QString name() const { return "classify"; }
+
+    bool process(QArtm::StageJob * stageJob)
+    {
+        IngestJob * job = static_cast<IngestJob*>(stageJob);
+        // nothing to classify with before the first training, input and Lab are worth it anyway
+        if (!job->indices.empty() || !job->engine)
+            return true;
+
+        // the tiles that look like those of the previous photo are copied from it
+        quint64 key = job->engine->classificationKey( job->sizeLimit );
+        QArtm::CountingEngine::Reference reference;
+        QArtm::CountingEngine::loadReference( job->archive, job->hash, key, job->fingerprints,
+                                              job->lab.size(), reference );
+        int reused = job->engine->classify( job->lab, job->fingerprints, reference, job->indices, job->dists );
+        m_ingest->m_tiles.fetchAndAddRelaxed( job->fingerprints.rows );
+        m_ingest->m_reusedTiles.fetchAndAddRelaxed( reused );
+        job->lab = cv::Mat();
+
+        return QArtm::CountingEngine::saveClassification( job->archive, job->hash, job->indices, job->dists, key )
+                && QArtm::CountingEngine::saveFingerprints( job->archive, job->hash, job->fingerprints, key );
+    }
+
+protected:
+    SnapshotIngest * m_ingest;
+};
+
+class MaskStage : public QArtm::StageScheduler::Stage
+{
+public:
+    QString name() const { return "mask"; }
+
+    bool process(QArtm::StageJob * stageJob)
+    {
+        IngestJob * job = static_cast<IngestJob*>(stageJob);
+        if (!job->indices.empty())
+            job->masks = QArtm::CountingEngine::cardMasks( job->indices, job->dists, job->threshold );
+        job->indices = job->dists = cv::Mat();
+        return true;
+    }
+};
+
+class ContoursStage : public QArtm::StageScheduler::Stage
+{
+public:
+    QString name() const { return "contours"; }
+
+    bool process(QArtm::StageJob * stageJob)
+    {
+        IngestJob * job = static_cast<IngestJob*>(stageJob);
+        foreach(const cv::Mat& mask, job->masks)
+            job->counts << (int)QArtm::CountingEngine::cardContours( mask, job->sizeFilter ).size();
+        job->masks.clear();
+        return true;
+    }
+};
+
+SnapshotIngest::SnapshotIngest(QThread::Priority priority, QObject *parent) :
+    QObject(parent),
+    // don't compete with counting what's on screen
+    m_scheduler(new QArtm::StageScheduler( qMax(1, QThread::idealThreadCount() / 2),
+                                           priority, this )),
+    m_generation(0)
+{
+    m_scheduler->addStage( new DecodeStage(this) );
+    m_scheduler->addStage( new LabStage );
+    m_scheduler->addStage( new ClassifyStage(this) );
+    m_scheduler->addStage( new MaskStage );
+    m_scheduler->addStage( new ContoursStage );
+    connect(m_scheduler, SIGNAL(finished(QArtm::StageJobPtr)), SLOT(jobFinished(QArtm::StageJobPtr)));
+    connect(m_scheduler, SIGNAL(dropped(QArtm::StageJobPtr)), SLOT(jobDropped(QArtm::StageJobPtr)));
+}
+
+SnapshotIngest::~SnapshotIngest()
+{
+    m_scheduler->clear();
+    m_scheduler->waitForIdle();
+}
+
+void SnapshotIngest::setDirectory(const QString &path, CacheArchivePtr archive)
+{
+    clear();
+    m_scheduler->waitForIdle();
+
+    m_dir = QDir(path);
+    m_archive = archive;
+    reloadEngine();
+}
+
+void SnapshotIngest::clear()
+{
+    m_generation++;
+    m_scheduler->clear();
+}
+
+void SnapshotIngest::enqueue(const QString &path, int sizeLimit, int threshold, int sizeFilter)
+{
+    if (!m_archive)
+        return;
+
+    IngestJob * job = new IngestJob;
+    job->path = path;
+    job->generation = m_generation;
+    job->sizeLimit = sizeLimit;
+    job->threshold = threshold;
+    job->sizeFilter = sizeFilter;
+    job->archive = m_archive;
+    m_scheduler->submit( QArtm::StageJobPtr(job) );
+}
+
+void SnapshotIngest::jobFinished(QArtm::StageJobPtr stageJob)
+{
+    IngestJob * job = static_cast<IngestJob*>( stageJob.data() );
+    if (job->generation != m_generation)
+        return;
+
+    qDebug() << "Ingested" << qPrintable(job->path) << job->counts;
+    qDebug() << qPrintable( report() );
+    emit ingested( job->path, job->counts );
+}
+
+void SnapshotIngest::jobDropped(QArtm::StageJobPtr stageJob)
+{
+    IngestJob * job = static_cast<IngestJob*>( stageJob.data() );
+    if (job->generation != m_generation)
+        return;
+
+    qWarning() << "Couldn't ingest" << qPrintable(job->path);
+    emit failed( job->path );
+}
+
+QString SnapshotIngest::report() const
+{
+    int tiles = m_tiles;
+    int reused = m_reusedTiles;
+    QString result = m_scheduler->report();
+    if (tiles)
+        result += QString("\nreused %1 of %2 classified tiles (%3%) from previous photos")
+                .arg(reused).arg(tiles).arg( 100.0 * reused / tiles, 0, 'f', 1 );
+    return result;
+}
+
+// until there is a palette to load every job tries again
+CountingEnginePtr SnapshotIngest::engine()
+{
+    QMutexLocker locker(&m_engineLock);
+    if (!m_engine) {
+        QSharedPointer< QArtm::CountingEngine > engine( new QArtm::CountingEngine );
+        if (engine->load( m_dir ))
+            m_engine = engine;
+    }
+    return m_engine;
+}
+
+// jobs in flight keep the old palette
+void SnapshotIngest::reloadEngine()
+{
+    QMutexLocker locker(&m_engineLock);
+    m_engine.clear();
+}
@@ -0,0 +1,69 @@
+#ifndef SNAPSHOTINGEST_HPP
+#define SNAPSHOTINGEST_HPP
+
+#include <QtCore>
+
+#include "SnapshotModel.hpp"
+#include "StageScheduler.hpp"
+
+// Speculatively runs the whole pipeline for photos that arrive while the
+// user looks at something else: decode, Lab, classification with the
+// directory's current palette, card masks and contours. Matrices land in
+// the cache archive, so opening them later only maps them, and the counts
+// go to the catalogue. The stages run on a few low priority workers, see
+// StageScheduler.
+class SnapshotIngest : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SnapshotIngest(QThread::Priority priority = QThread::LowestPriority, QObject *parent = 0);
+    ~SnapshotIngest();
+
+    // drops whatever is queued for the previous directory
+    void setDirectory(const QString& path, CacheArchivePtr archive);
+    void enqueue(const QString& path, int sizeLimit, int threshold, int sizeFilter);
+    // drops whatever is queued; photos already started are still finished,
+    // but they aren't reported any more
+    void clear();
+    // photos already started are still finished
+    void setPaused(bool paused) { m_scheduler->setPaused(paused); }
+    bool isPaused() const { return m_scheduler->isPaused(); }
+
+    // stage timings and how much classification was reused
+    QString report() const;
+
+    // the directory's current palette, null before the first training
+    CountingEnginePtr engine();
+    // the palette was trained again, the next jobs load it
+    void reloadEngine();
+
+signals:
+    // counts are empty if there's no palette to classify with yet
+    void ingested(const QString& path, const QVector<int>& counts);
+    // couldn't be decoded or its classification couldn't be stored
+    void failed(const QString& path);
+
+protected slots:
+    void jobFinished(QArtm::StageJobPtr job);
+    void jobDropped(QArtm::StageJobPtr job);
+
+protected:
+    friend class DecodeStage;
+    friend class ClassifyStage;
+
+
+    QArtm::StageScheduler * m_scheduler;
+    CacheArchivePtr m_archive;
+    QDir m_dir;
+    // bumped by clear(), jobs enqueued before are stale
+    int m_generation;
+
+    // what the classifier stages share, loaded on first use
+    QMutex m_engineLock;
+    CountingEnginePtr m_engine;
+
+    // tiles the classifier stage went through, and those copied instead
+    QAtomicInt m_tiles, m_reusedTiles;
+};
+
+#endif // SNAPSHOTINGEST_HPP
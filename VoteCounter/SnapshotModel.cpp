@@ -4,6 +4,12 @@
 #include "QMetaUtilities.hpp"
 #include "MouseLogic.hpp"
 #include "ScopedTimer.hpp"
+#include "Throttle.hpp"
+#include "ImageLoader.hpp"
+#include "CacheArchive.hpp"
+#include "MatrixJournal.hpp"
+#include "MatrixFile.hpp"
+#include "BufferPool.hpp"
 
 #include "QOpenCV.hpp"
 using namespace QOpenCV;
@@ -11,25 +17,45 @@ using namespace QOpenCV;
 #include <qt-json/json.h>
 using namespace QtJson;
 
-QStringSet SnapshotModel::s_cacheableImages = QStringSet() << "input";
-QStringSet SnapshotModel::s_resizedImages = QStringSet() << "input";
 QStringList SnapshotModel::s_colorNames = QStringList() << "green" << "pink" << "yellow";
 QStringList SnapshotModel::s_persistentMasks = QStringList()
 << "train.contours.green" << "train.contours.pink" << "train.contours.yellow";
 
-SnapshotModel::SnapshotModel(const QString& path, QObject *parent) :
+SnapshotModel::SnapshotModel(const QString& path, CacheArchivePtr archive, QObject *parent) :
     QObject(parent),
     m_originalPath(path),
+    m_archive(archive),
     m_scene(new QGraphicsScene(this)),
     m_mouseLogic( new MouseLogic(m_scene) ),
     m_mode(INERT),
     m_color("green"),
-    m_flann(0),
     m_showColorDiff(false),
     m_countWatcher(this),
+    m_inputWatcher(this),
+    m_inputItem(0),
+    m_countRequested(false),
+    m_active(true),
+    m_classifiedKey(0),
+    m_countedKey(0),
+    m_classificationArchived(false),
+    m_tilesDone(0),
+    m_countGeneration(0),
+    m_countingGeneration(0),
+    m_countingKey(0),
+    m_partialThrottle( new QArtm::Throttle(250) ),
     m_networkManager( new QNetworkAccessManager(this) )
 {
 
+    // the input is wrapped by its image and masks are drawn on; the rest can be had again when memory gets tight
+    m_matrices.define( "input", CV_8UC3, QArtm::MatrixRegistry::PINNED, 0 );
+    m_matrices.define( "lab", CV_32FC3, QArtm::MatrixRegistry::MAPPED, 5 );
+    m_matrices.define( "indices", CV_32SC1, QArtm::MatrixRegistry::MAPPED, 10 );
+    m_matrices.define( "dists", CV_32FC1, QArtm::MatrixRegistry::MAPPED, 10 );
+    m_matrices.define( "colorDiff", CV_8UC3, QArtm::MatrixRegistry::COMPUTED, 40 );
+    m_matrices.define( "train.contours.", CV_8UC1, QArtm::MatrixRegistry::PINNED, 0 );
+    m_matrices.define( "count.contours.", CV_8UC1, QArtm::MatrixRegistry::PINNED, 0 );
+    m_matrices.setBudget( ACTIVE_MATRIX_BUDGET );
+
     m_pens["counted"] = QPen(QColor(100,100,255, 200), 2);
     m_pens["+selection"] = QPen(QColor(128,255,128,128), 0);
     m_pens["-selection"] = QPen(QColor(255,128,128,128), 0);
@@ -39,42 +65,46 @@ SnapshotModel::SnapshotModel(const QString& path, QObject *parent) :
 
     m_mouseLogic->setObjectName("mouseLogic");
     m_countWatcher.setObjectName("countWatcher");
+    m_inputWatcher.setObjectName("inputWatcher");
     m_networkManager->setObjectName("http");
 
-    QMetaUtilities::connectSlotsByName( parent, this );
+    // parked snapshots are the shell's children too and their members have
+    // the same names, so ours are connected by hand and only the shell's
+    // widgets by name
+    connect(m_mouseLogic, SIGNAL(pointClicked(QPointF,Qt::MouseButton,Qt::KeyboardModifiers)),
+            SLOT(on_mouseLogic_pointClicked(QPointF,Qt::MouseButton,Qt::KeyboardModifiers)));
+    connect(m_mouseLogic, SIGNAL(rectUpdated(QRectF,Qt::MouseButton,Qt::KeyboardModifiers)),
+            SLOT(on_mouseLogic_rectUpdated(QRectF,Qt::MouseButton,Qt::KeyboardModifiers)));
+    connect(m_mouseLogic, SIGNAL(rectSelected(QRectF,Qt::MouseButton,Qt::KeyboardModifiers)),
+            SLOT(on_mouseLogic_rectSelected(QRectF,Qt::MouseButton,Qt::KeyboardModifiers)));
+    connect(&m_countWatcher, SIGNAL(finished()), SLOT(on_countWatcher_finished()));
+    connect(&m_inputWatcher, SIGNAL(finished()), SLOT(on_inputWatcher_finished()));
+    connect(m_networkManager, SIGNAL(finished(QNetworkReply*)), SLOT(on_http_finished(QNetworkReply*)));
+    QMetaUtilities::connectSlotsByName( parent, this, true );
+    connect(this, SIGNAL(tileClassified(QRect,int)), SLOT(mergeClassifiedTile(QRect,int)), Qt::QueuedConnection);
 
     qDebug() << "Loading" << qPrintable(path);
 
-    // check if cache is present, create otherwise
-    QFileInfo fi(path);
+    m_parentDir = QFileInfo(path).absoluteDir();
 
-    m_parentDir = fi.absoluteDir();
-    m_cacheDir = m_parentDir.filePath( fi.baseName() + ".cache" );
-    if (!m_cacheDir.exists()) {
-        qDebug() << "creating cache directory" << qPrintable(m_cacheDir.path());
-        m_parentDir.mkdir( m_cacheDir.dirName() );
-    }
+    // show a preview at the final geometry right away, the full input is
+    // decoded and scaled in the background and replaces it when ready
+    int size_limit = m_sizeLimit = uiValue("sizeLimit").toInt();
+    QSize inputSize = QArtm::ImageLoader::scaledSize( path, size_limit );
+    m_scene->setSceneRect( QRectF( QPointF(0,0), inputSize ) );
 
-    // add the image to the scene
-    m_scene->addPixmap( QPixmap::fromImage( getImage("input") ) );
+    QImage preview = QArtm::ImageLoader::preview( path );
+    m_inputItem = m_scene->addPixmap( QPixmap::fromImage( preview ) );
+    if (!preview.isNull())
+        m_inputItem->setTransform( QTransform::fromScale( (qreal)inputSize.width() / preview.width(),
+                                                          (qreal)inputSize.height() / preview.height() ) );
 
-    loadData();
+    m_inputWatcher.setFuture( QtConcurrent::run( &SnapshotModel::readInput, m_archive, path, size_limit ) );
 
     // try to load flann
-    QString palette_file = m_parentDir.filePath("palette.png");
-    QString flann_file = m_parentDir.filePath("flann.dat");
-    if ( QFileInfo(palette_file).exists() && QFileInfo(flann_file).exists()) {
-        cv::Mat paletteRGB = cv::imread( palette_file.toStdString(), -1 );
-        cv::Mat paletteLab;
-        paletteRGB.convertTo(paletteLab, CV_32FC3, 1.0/255.0);
-        cv::cvtColor( paletteLab, paletteLab, CV_RGB2Lab );
-
-        setMatrix("paletteRGB", cv::Mat(paletteRGB.rows, 3, CV_8UC1, paletteRGB.data).clone());
-        setMatrix("paletteLab", cv::Mat(paletteLab.rows, 3, CV_32FC1, paletteLab.data).clone());
-
-        cvflann::SavedIndexParams params(flann_file.toStdString());
-        m_flann = new cv::flann::GenericIndex< ColorDistance >(getMatrix("paletteLab"), params);
-
+    QSharedPointer< QArtm::CountingEngine > engine( new QArtm::CountingEngine );
+    if (engine->load( m_parentDir )) {
+        m_engine = engine;
         showPalette();
     }
 
@@ -84,7 +114,80 @@ SnapshotModel::SnapshotModel(const QString& path, QObject *parent) :
 SnapshotModel::~SnapshotModel()
 {
     qDebug() << "closing snapshot...";
-    saveData();
+    // counting workers call back into us, stop them at the next tile
+    cancelCount(true);
+    m_inputWatcher.waitForFinished();
+    // masks are loaded together with the input, don't wipe them if it never came;
+    // saving only queues them, the journal writes them in the background
+    if (m_images.contains("input"))
+        saveData();
+    delete m_partialThrottle;
+}
+
+void SnapshotModel::setActive(bool active)
+{
+    if (active == m_active)
+        return;
+    m_active = active;
+
+    // a parked snapshot doesn't compete with the one on screen for the
+    // workers; it counts again when it comes back
+    if (!active) {
+        m_countRequested = false;
+        cancelCount();
+    }
+
+    if (active)
+        QMetaUtilities::connectSlotsByName( parent(), this, true );
+    else
+        QMetaUtilities::disconnectSlotsByName( parent(), this );
+
+    // a parked snapshot keeps its scene, the matrices behind it come back on demand
+    m_matrices.setBudget( active ? ACTIVE_MATRIX_BUDGET : PARKED_MATRIX_BUDGET );
+    evictMatrices();
+}
+
+void SnapshotModel::evictMatrices()
+{
+    // classification is being merged into or isn't in the archive; a read
+    // only archive drops the writes, and a save can fail
+    QStringList busy;
+    if (m_countWatcher.isRunning() || m_classifiedKey != classificationKey()
+            || !m_classificationArchived || m_archive->isReadOnly())
+        busy << "indices" << "dists";
+
+    // the classification buffers are only needed while tiles are merged
+    if (!m_countWatcher.isRunning())
+        m_workIndices = m_workDists = cv::Mat();
+
+    QStringList evicted = m_matrices.evict( busy );
+    if (evicted.isEmpty())
+        return;
+    qDebug() << "Evicted" << evicted << "of" << qPrintable(m_originalPath);
+    // the published result would keep them in memory
+    if (evicted.contains("indices") || evicted.contains("dists"))
+        m_result.clear();
+    qDebug() << qPrintable( m_matrices.usage() );
+    qDebug() << qPrintable( QArtm::BufferPool::instance()->report() );
+}
+
+bool SnapshotModel::isCurrent()
+{
+    return m_sizeLimit == uiValue("sizeLimit").toInt();
+}
+
+int SnapshotModel::memoryCost() const
+{
+    qint64 bytes = m_matrices.bytes();
+    bytes += m_workIndices.total() * m_workIndices.elemSize();
+    bytes += m_workDists.total() * m_workDists.elemSize();
+    // "input" wraps its matrix, the rest are pixmaps and overlays of their own
+    foreach(const QString& tag, m_images.keys())
+        if (tag != "input")
+            bytes += m_images[tag].byteCount();
+    if (m_inputItem)
+        bytes += (qint64)m_inputItem->pixmap().width() * m_inputItem->pixmap().height() * 4;
+    return bytes / 1024 + 1;
 }
 
 QVariant SnapshotModel::uiValue(const QString &name, const char * property)
@@ -99,14 +202,24 @@ void SnapshotModel::pick(int x, int y)
     QString layerName;
     if (input.rect().contains(x,y)) {
         switch(m_mode) {
-        case COUNT:
-            if (!m_matrices.contains("indices")) {
+        case COUNT: {
+            // evicted ones come back from the archive, unless that failed
+            cv::Mat indices, dists;
+            if (m_matrices.contains("indices") || (m_classificationArchived && m_classifiedKey == classificationKey())) {
+                indices = getMatrix("indices");
+                dists = getMatrix("dists");
+            }
+            if (indices.empty() || dists.empty()) {
                 qWarning() << "Count cards first!";
                 return;
+            } else if (dists.at<float>(y,x) == std::numeric_limits<float>::max()) {
+                qWarning() << "This part of the snapshot isn't counted yet";
+                return;
             } else
                 // use the result of previous pixel classification
-                layerName = "count.contours." + s_colorNames[ getMatrix("indices").at<int>(y,x) / COLOR_GRADATIONS ];
+                layerName = "count.contours." + s_colorNames[ indices.at<int>(y,x) / QArtm::CountingEngine::COLOR_GRADATIONS ];
             break;
+        }
         case TRAIN:
             layerName = "train.contours." + m_color;
             break;
@@ -124,6 +237,43 @@ void SnapshotModel::setTrainMode(const QString &tag)
     updateViews();
 }
 
+void SnapshotModel::on_inputWatcher_finished()
+{
+    acceptInput();
+}
+
+// takes over the input decoded in the background and does what depends on it
+void SnapshotModel::acceptInput()
+{
+    if (m_images.contains("input"))
+        return;
+
+    // the image shares pixels with the (possibly memory mapped) matrix
+    DecodedInput decoded = m_inputWatcher.result();
+    m_contentHash = decoded.contentHash;
+    cv::Mat input = decoded.input;
+    setMatrix("input", input);
+    setImage("input", QImage( (const uchar *)input.data, input.cols, input.rows, input.step, QImage::Format_RGB888 ));
+    m_inputItem->setPixmap( QPixmap::fromImage( getImage("input") ) );
+    m_inputItem->resetTransform();
+
+    loadData();
+    updateViews();
+
+    if (m_countRequested) {
+        m_countRequested = false;
+        on_count_clicked();
+    }
+}
+
+QVector<int> SnapshotModel::counts()
+{
+    QVector<int> result;
+    foreach(QString color, s_colorNames)
+        result << layer("count.contours." + color)->childItems().count();
+    return result;
+}
+
 void SnapshotModel::updateViews()
 {
     layer("train")->setVisible(false);
@@ -160,36 +310,84 @@ void SnapshotModel::updateViews()
 
 void SnapshotModel::saveData()
 {
+    // every edit is journaled already, this folds them into whole masks;
+    // the journal owns the copies, we may be gone before they're written
     foreach(QString name, s_persistentMasks) {
-        QString fname = m_cacheDir.filePath(name + ".png");
         if (m_matrices.contains(name)) {
-            cv::imwrite( fname.toStdString(), getMatrix(name) );
-        } else if (QFile( fname ).exists()) {
-            QFile( fname ).remove();
+            m_archive->journal()->checkpoint( contentHash(), name, getMatrix(name).clone() );
+            saveContours(name);
+        } else {
+            m_archive->journal()->checkpoint( contentHash(), name, cv::Mat() );
+            m_archive->remove( contentHash(), name + ".polygons" );
         }
     }
 }
 
+static quint32 maskChecksum(const cv::Mat& mask)
+{
+    return MatrixFile::checksum( mask.data, (qint64)mask.rows * mask.step );
+}
+
+// the polygons on the scene follow every edit of the mask, so they're what
+// detectContours would find in it now; the checksum tells if they still are
+void SnapshotModel::saveContours(const QString &name)
+{
+    QList< QPolygon > polygons;
+    foreach(QGraphicsItem * child, layer(name)->childItems())
+        if (QGraphicsPolygonItem * poly_item = qgraphicsitem_cast<QGraphicsPolygonItem*>(child))
+            polygons << poly_item->polygon().toPolygon();
+
+    QByteArray data;
+    QDataStream out( &data, QIODevice::WriteOnly );
+    out << maskChecksum( getMatrix(name) ) << polygons;
+    m_archive->write( contentHash(), name + ".polygons", data );
+}
+
+bool SnapshotModel::loadContours(const QString &name)
+{
+    QByteArray data = m_archive->read( contentHash(), name + ".polygons" );
+    if (data.isEmpty())
+        return false;
+
+    quint32 checksum;
+    QList< QPolygon > polygons;
+    QDataStream in(data);
+    in >> checksum >> polygons;
+    if (in.status() != QDataStream::Ok || checksum != maskChecksum( getMatrix(name) ))
+        return false;
+
+    foreach(const QPolygon& polygon, polygons)
+        addContour(polygon, name);
+    return true;
+}
+
 void SnapshotModel::loadData()
 {
     cv::Mat input = getMatrix("input");
-    int mrows = input.rows, mcols = input.cols;
 
     foreach(QString name, s_persistentMasks) {
-        QString fname = m_cacheDir.filePath(name + ".png");
-        if ( QFile(fname).exists() ) {
-            cv::Mat mask = cv::imread( fname.toStdString(), 0);
-            if (mask.rows == mrows && mask.cols == mcols) {
-                setMatrix(name, mask);
+        cv::Mat mask = m_archive->journal()->restore( contentHash(), name, input.size(), CV_8UC1 );
+        if (!mask.empty()) {
+            setMatrix(name, mask);
+            if (!loadContours(name)) {
                 detectContours(name);
-            } else {
-                qDebug() << "Incompatible mask" << fname << ", removing";
-                QFile(fname).remove();
+                saveContours(name);
             }
         }
     }
 }
 
+void SnapshotModel::journalEdit(const QString &name, const cv::Rect &roi)
+{
+    if (!s_persistentMasks.contains(name) || !m_matrices.contains(name))
+        return;
+
+    cv::Mat mask = getMatrix(name);
+    cv::Rect bounded = roi & cv::Rect(0, 0, mask.cols, mask.rows);
+    if (bounded.area())
+        m_archive->journal()->patch( contentHash(), name, bounded, cv::Mat(mask, bounded).clone() );
+}
+
 QGraphicsItem * SnapshotModel::layer(const QString &name)
 {
     if (!m_layers.contains(name)) {
@@ -238,6 +436,7 @@ void SnapshotModel::floodPickContour(int x, int y, int fuzz, const QString& laye
     // merge masks
     cv::Rect img_bounds = bounds - cv::Point(1,1);
     cv::Mat(mask, img_bounds) |= cv::Mat(pickMask, bounds) * 255;
+    journalEdit( layerName, img_bounds );
 
     // if intersected some polygons - remove these polygons and grow ROI with their bounds
     QRect q_bounds = toQt(img_bounds);
@@ -265,7 +464,9 @@ void SnapshotModel::unpick(int x, int y)
 
         // (un)draw this contour onto the mask
         cv::Mat mask = getMatrix(layerName);
-        cv::floodFill( mask, cv::Point(x,y), cv::Scalar(0), 0, cv::Scalar(), cv::Scalar(), 4 | cv::FLOODFILL_FIXED_RANGE);
+        cv::Rect erased;
+        cv::floodFill( mask, cv::Point(x,y), cv::Scalar(0), &erased, cv::Scalar(), cv::Scalar(), 4 | cv::FLOODFILL_FIXED_RANGE);
+        journalEdit( layerName, erased );
 
         // delete the polygon itself
         delete unpicked_poly;
@@ -276,56 +477,25 @@ void SnapshotModel::unpick(int x, int y)
 
 void SnapshotModel::on_learn_clicked()
 {
-    QVector<cv::Mat> centers_list;
-    int centers_count = 0;
-    cv::Mat input = getMatrix("lab");
+    QList<cv::Mat> trainingMasks;
+    foreach(QString matrixTag, m_matrices.names())
+        if (matrixTag.startsWith("train.contours."))
+            trainingMasks << getMatrix(matrixTag);
 
-    int color_index = 0;
-
-    foreach(QString matrixTag, m_matrices.keys()) {
-        if (!matrixTag.startsWith("train.contours.")) continue;
-
-        QVector<ColorType> sample_pixels;
-        cv::Mat mask = getMatrix(matrixTag);
-
-        for(int i = 0; i<input.rows; ++i)
-            for(int j = 0; j<input.cols; ++j)
-                if (mask.at<unsigned char>(i,j))
-                    // copy this pixel
-                    sample_pixels
-                            << input.ptr<ColorType>(i)[j*3]
-                            << input.ptr<ColorType>(i)[j*3+1]
-                            << input.ptr<ColorType>(i)[j*3+2];
-
-        if (sample_pixels.size()==0) continue;
-
-        cv::Mat sample(sample_pixels.size()/3, 3, CV_32FC1, sample_pixels.data());
-        // cv::flann::hierarchicalClustering returns float centers even for integer palette
-        cv::Mat centers(COLOR_GRADATIONS, 3, CV_32FC1);
-        cvflann::KMeansIndexParams params(
-                    COLOR_GRADATIONS, // branching
-                    10, // max iterations
-                    cvflann::FLANN_CENTERS_KMEANSPP,
-                    0);
-        int n_clusters = cv::flann::hierarchicalClustering< ColorDistance >( sample, centers, params );
-        centers_list << centers;
-        centers_count += n_clusters;
-        color_index++;
-    }
-
-    cv::Mat paletteLab = cv::Mat( centers_count, 3, CV_32FC1 );
-    for(int i=0; i<centers_list.size(); ++i)
-        centers_list[i].copyTo( paletteLab.rowRange( i*COLOR_GRADATIONS,(i+1)*COLOR_GRADATIONS ) );
-    m_matrices.remove("paletteRGB");
-    setMatrix("paletteLab", paletteLab);
+    QSharedPointer< QArtm::CountingEngine > engine( new QArtm::CountingEngine );
+    engine->setPalette( QArtm::CountingEngine::learnPalette( getMatrix("lab"), trainingMasks ) );
+    engine->save( m_parentDir );
 
-    showPalette();
+    // the running count keeps the engine it started with, but its cards are stale
+    cancelCount();
+    m_engine = engine;
 
-    buildFlannRecognizer();
+    showPalette();
 
     qDebug() << "built FLANN classifier";
 
     updateViews();
+    emit paletteLearned();
 
 }
 
@@ -333,82 +503,237 @@ void SnapshotModel::on_count_clicked()
 {
     if (m_mode != COUNT)
         return;
-    if (!m_flann) {
+    if (!m_engine) {
         qDebug() << "Teach me the colors first";
         return;
     }
 
+    if (m_countWatcher.isRunning()) {
+        if (m_countingKey == classificationKey())
+            return;
+        // the palette changed under it
+        cancelCount();
+    }
+    if (!m_images.contains("input")) {
+        // count as soon as the input is decoded
+        m_countRequested = true;
+        return;
+    }
+
+    // switching back to a snapshot kept in memory, its cards are up to date
+    if (m_countedKey && m_countedKey == countKey()) {
+        emit doneCounting();
+        return;
+    }
+
     emit willCount();
-    m_countWatcher.setFuture( QtConcurrent::run( this, &SnapshotModel::classifyPixels ) );
+
+    CountJob job;
+    job.engine = m_engine;
+    job.key = classificationKey();
+    job.threshold = uiValue("colorDiffThreshold").toInt();
+    job.sizeFilter = uiValue("sizeFilter").toInt();
+    job.archive = m_archive;
+    job.hash = contentHash();
+    m_countTiles.clear();
+
+    // revisiting a snapshot classified with the current palette, only the
+    // cards are counted again
+    if (m_result && m_result->classificationKey == job.key) {
+        job.indices = m_result->indices;
+        job.dists = m_result->dists;
+        job.classified = true;
+        job.archived = m_result->archived;
+    } else if (QArtm::CountingEngine::loadClassification( m_archive, contentHash(), job.key, job.indices, job.dists )) {
+        job.classified = true;
+        job.archived = true;
+    } else {
+        // tiles around the middle of the view are classified first
+        job.lab = getMatrix("lab");
+        QPointF focus = m_scene->sceneRect().center();
+        foreach(QGraphicsView * view, m_scene->views()) {
+            focus = view->mapToScene( view->viewport()->rect().center() );
+            break;
+        }
+        m_countTiles = job.tiles = countingTiles( job.lab.size(), focus );
+        m_tilesDone = 0;
+        job.fingerprints = QArtm::CountingEngine::fingerprints( getMatrix("input") );
+        QArtm::CountingEngine::loadReference( m_archive, contentHash(), job.key, job.fingerprints,
+                                              job.lab.size(), job.reference );
+
+        int rows = job.lab.rows, cols = job.lab.cols;
+        QArtm::BufferPool * pool = QArtm::BufferPool::instance();
+        m_workIndices = job.indices = pool->matrix( rows, cols, CV_32SC1, cv::Scalar(0) );
+        m_workDists = job.dists = pool->matrix( rows, cols, CV_32FC1 );
+        job.classified = false;
+        job.archived = false;
+
+        // partial results are merged here tile by tile; pixels that aren't
+        // classified yet are infinitely far from the palette
+        setMatrix("indices", pool->matrix( rows, cols, CV_32SC1, cv::Scalar(0) ));
+        setMatrix("dists", pool->matrix( rows, cols, CV_32FC1, cv::Scalar(std::numeric_limits<float>::max()) ));
+    }
+
+    job.generation = m_countingGeneration = m_countGeneration.fetchAndAddOrdered(1) + 1;
+    m_countingKey = job.key;
+    bool done = true;
+    foreach(QFuture<CountResultPtr> task, m_countTasks.futures())
+        done = done && task.isFinished();
+    if (done)
+        m_countTasks.clearFutures();
+    QFuture<CountResultPtr> task = QtConcurrent::run( this, &SnapshotModel::runCount, job );
+    m_countTasks.addFuture(task);
+    m_countWatcher.setFuture(task);
 }
 
-void SnapshotModel::on_countWatcher_finished()
+void SnapshotModel::cancelCount(bool wait)
 {
-    computeColorDiff();
-    countCards();
-    updateViews();
-    emit doneCounting();
+    if (m_countWatcher.isRunning()) {
+        m_countGeneration.ref();
+        qDebug() << "Cancelled count" << m_countingGeneration << "of" << qPrintable(m_originalPath);
+        emit countCancelled();
+    }
+    if (wait)
+        m_countTasks.waitForFinished();
 }
 
-
-void SnapshotModel::classifyPixels()
+QList< cv::Rect > SnapshotModel::countingTiles(const cv::Size& size, const QPointF& focus)
 {
-    QArtm::ScopedTimer timer("K-Nearest Neighbour Search");
+    QMultiMap< qreal, cv::Rect > byDistance;
+    foreach(const cv::Rect& tile, QArtm::CountingEngine::tiles( size )) {
+        QPointF center( tile.x + tile.width / 2.0, tile.y + tile.height / 2.0 );
+        byDistance.insert( QLineF(center, focus).length(), tile );
+    }
+    return byDistance.values();
+}
 
-    cv::Mat input = getMatrix("lab");
+void SnapshotModel::mergeClassifiedTile(QRect tile, int generation)
+{
+    if (generation != m_countGeneration || m_workIndices.empty())
+        return;
 
-    int n_pixels = input.rows * input.cols;
-    cv::Mat indices( input.rows, input.cols, CV_32SC1 );
-    cv::Mat dists( input.rows, input.cols, CV_32FC1 );
+    cv::Rect roi = toCv(tile);
+    cv::Mat indices( getMatrix("indices"), roi ), dists( getMatrix("dists"), roi );
+    cv::Mat(m_workIndices, roi).copyTo( indices );
+    cv::Mat(m_workDists, roi).copyTo( dists );
 
-    cv::Mat input_1 = input.reshape( 1, n_pixels ),
-            indices_1 = indices.reshape( 1, n_pixels ),
-            dists_1 = dists.reshape( 1, n_pixels );
+    m_tilesDone++;
+    emit countProgress(m_tilesDone, m_countTiles.size());
 
-    cvflann::SearchParams params(cvflann::FLANN_CHECKS_UNLIMITED, 0);
-    m_flann->knnSearch( input_1, indices_1, dists_1, 1, params);
+    // show what we've got so far, the final result comes with countWatcher
+    if (m_tilesDone < m_countTiles.size() && m_partialThrottle->mayI()) {
+        computeColorDiff();
+        countCards();
+        updateViews();
+    }
+}
 
-    setMatrix("indices", indices);
-    setMatrix("dists", dists);
+void SnapshotModel::on_countWatcher_finished()
+{
+    if (m_countingGeneration != m_countGeneration)
+        return;
+    CountResultPtr result = m_countWatcher.result();
+    if (result)
+        publishResult(result);
 }
 
-void SnapshotModel::computeColorDiff()
+// The gui thread swaps the new version in, the previous one goes away once
+// nothing refers to it any more. The published result stays as it is, the
+// count masks get copies because picking draws on them.
+void SnapshotModel::publishResult(CountResultPtr result)
 {
-    float thresh = parent()->findChild<QAbstractSlider*>("colorDiffThreshold")->value();
-    thresh = 3.0 * thresh * thresh;
+    m_result = result;
+    m_classifiedKey = result->classificationKey;
+    m_classificationArchived = result->archived;
+    // all tiles are merged, the result holds the classification now
+    m_workIndices = m_workDists = cv::Mat();
+    setMatrix("indices", result->indices);
+    setMatrix("dists", result->dists);
+    for(int i = 0; i < result->masks.size(); i++)
+        setMatrix( "count.contours." + s_colorNames[i], result->masks[i].clone() );
+
+    showColorDiff();
+    for(int i = 0; i < result->cards.size(); i++)
+        showCards( "count.contours." + s_colorNames[i], result->cards[i] );
+    m_countedKey = QArtm::CountingEngine::countKey( result->classificationKey, result->threshold, result->sizeFilter );
 
-    cv::Mat thresholdedDiff;
-    cv::threshold(getMatrix("dists"), thresholdedDiff, thresh, 0, cv::THRESH_TRUNC);
-    thresholdedDiff.convertTo( thresholdedDiff, CV_8UC1, - 255.0 / thresh, 255.0 );
+    updateViews();
+    evictMatrices();
+    emit doneCounting();
+}
 
-    // poor man's LookUpTable
-    cv::Mat indices = getMatrix("indices");
-    int n_pixels = indices.rows * indices.cols;
-    cv::Mat lut = getMatrix("paletteRGB");
-    // actual per-card-color masks
-    QVector<cv::Mat> cardMasks;
-    for(int i=0; i<3; i++)
-        cardMasks << cv::Mat(  indices.rows, indices.cols, CV_8UC1, cv::Scalar(0) );
+quint64 SnapshotModel::classificationKey() const
+{
+    return m_engine ? m_engine->classificationKey( m_sizeLimit ) : 0;
+}
 
-    for(int i=0; i<n_pixels; i++) {
-        if (thresholdedDiff.data[i]) {
-            int index = indices.ptr<int>(0)[i];
-            int color = index / COLOR_GRADATIONS;
-            cardMasks[color].data[i] = 1;
+quint64 SnapshotModel::countKey()
+{
+    return QArtm::CountingEngine::countKey( classificationKey(), uiValue("colorDiffThreshold").toInt(),
+                                            uiValue("sizeFilter").toInt() );
+}
+
+// runs on a worker: classifies what isn't yet and counts the cards, with
+// everything it needs in the job and nothing of ours touched but the
+// generation it checks between tiles
+SnapshotModel::CountResultPtr SnapshotModel::runCount(CountJob job)
+{
+    QArtm::ScopedTimer timer("Counting");
+
+    int reused = 0;
+    if (!job.classified) {
+        foreach(cv::Rect tile, job.tiles) {
+            if (job.generation != m_countGeneration)
+                return CountResultPtr();
+            if (QArtm::CountingEngine::reuseTile( job.reference, job.fingerprints, tile, job.indices, job.dists ))
+                reused++;
+            else
+                job.engine->classifyTile( job.lab, tile, job.indices, job.dists );
+            emit tileClassified( toQt(tile), job.generation );
         }
+        job.archived = QArtm::CountingEngine::saveClassification( job.archive, job.hash, job.indices, job.dists, job.key );
+        QArtm::CountingEngine::saveFingerprints( job.archive, job.hash, job.fingerprints, job.key );
+        if (job.reference.isValid())
+            qDebug() << qPrintable( QString("Reused %1 of %2 tiles (%3%) of the previous photo")
+                                    .arg(reused).arg(job.tiles.size())
+                                    .arg( 100.0 * reused / qMax(1, job.tiles.size()), 0, 'f', 1 ) );
     }
+    if (job.generation != m_countGeneration)
+        return CountResultPtr();
+
+    CountResult * result = new CountResult( QArtm::CountingEngine::count( job.indices, job.dists,
+                                                                          job.threshold, job.sizeFilter ) );
+    result->classificationKey = job.key;
+    result->archived = job.archived;
+    return CountResultPtr(result);
+}
 
-    for(int i=0; i<3; i++) {
-        cv::morphologyEx( cardMasks[i], cardMasks[i], cv::MORPH_OPEN, cv::Mat() );
-        setMatrix( "count.contours." + s_colorNames[i], cardMasks[i] );
-    }
+void SnapshotModel::computeColorDiff()
+{
+    int thresh = parent()->findChild<QAbstractSlider*>("colorDiffThreshold")->value();
+
+    QVector<cv::Mat> masks = QArtm::CountingEngine::cardMasks( getMatrix("indices"), getMatrix("dists"), thresh );
+    for(int i=0; i<masks.size(); i++)
+        setMatrix( "count.contours." + s_colorNames[i], masks[i] );
+    showColorDiff();
+}
+
+// the display of the count masks, poor man's LookUpTable
+void SnapshotModel::showColorDiff()
+{
+    cv::Mat indices = getMatrix("indices");
+    int n_pixels = indices.rows * indices.cols;
+    cv::Mat lut = m_engine->paletteRGB();
+    QVector<cv::Mat> masks;
+    for(int i=0; i<s_colorNames.size(); i++)
+        masks << getMatrix( "count.contours." + s_colorNames[i] );
 
-    // the display
-    cv::Mat colorDiff = cv::Mat( indices.rows, indices.cols, CV_8UC3, cv::Scalar(0,0,0,0) );
+    QArtm::BufferPool * pool = QArtm::BufferPool::instance();
+    cv::Mat colorDiff = pool->matrix( indices.rows, indices.cols, CV_8UC3, cv::Scalar(0,0,0,0) );
     for(int i=0; i<n_pixels; i++) {
         int index = indices.ptr<int>(0)[i];
-        int color = index / COLOR_GRADATIONS;
-        if (cardMasks[color].data[i]) {
+        int color = index / QArtm::CountingEngine::COLOR_GRADATIONS;
+        if (masks[color].data[i]) {
             colorDiff.data[i*3] = lut.data[ index*3 ];
             colorDiff.data[i*3+1] = lut.data[ index*3 + 1 ];
             colorDiff.data[i*3+2] = lut.data[ index*3 + 2 ];
@@ -425,112 +750,106 @@ void SnapshotModel::computeColorDiff()
 
 void SnapshotModel::countCards()
 {
-    int minSize = uiValue("sizeFilter").toInt();
-    minSize *= minSize;
+    int sizeFilter = uiValue("sizeFilter").toInt();
 
     for(int i = 0; i<3; i++) {
         QString layerName =  "count.contours." + s_colorNames[i];
+        showCards( layerName, QArtm::CountingEngine::cardContours( getMatrix(layerName), sizeFilter ) );
+    }
 
-        // clone mask because find contours corrupts
-        cv::Mat mask = getMatrix(layerName).clone();
-        std::vector< std::vector< cv::Point > > contours;
-        cv::findContours(mask, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_TC89_L1);
-        // now refresh contour visuals
-        clearLayer(layerName);
-        int count = 0;
-        foreach( const std::vector< cv::Point >& contour, contours ) {
-
-            if (minSize > cv::contourArea(contour) )
-                continue;
-
-            int simple = 1;
-            QPolygon polygon;
-            if (simple > 0) {
-                std::vector< cv::Point > approx;
-                // simplify contours
-                cv::approxPolyDP( contour, approx, simple, true);
-                polygon = toQPolygon(approx);
-            } else
-                polygon = toQPolygon(contour);
-            QGraphicsPolygonItem * poly_item = new QGraphicsPolygonItem( polygon, layer(layerName) );
-            poly_item->setPen(m_pens["counted"]);
-            count ++;
-        }
+    // partial counts don't count
+    if (!m_countWatcher.isRunning() && m_classifiedKey == classificationKey())
+        m_countedKey = countKey();
+}
+
+void SnapshotModel::showCards(const QString &layerName, const std::vector< std::vector< cv::Point > > &contours)
+{
+    // now refresh contour visuals
+    clearLayer(layerName);
+    foreach( const std::vector< cv::Point >& contour, contours ) {
+        int simple = 1;
+        QPolygon polygon;
+        if (simple > 0) {
+            std::vector< cv::Point > approx;
+            // simplify contours
+            cv::approxPolyDP( contour, approx, simple, true);
+            polygon = toQPolygon(approx);
+        } else
+            polygon = toQPolygon(contour);
+        QGraphicsPolygonItem * poly_item = new QGraphicsPolygonItem( polygon, layer(layerName) );
+        poly_item->setPen(m_pens["counted"]);
     }
 }
 
 QImage SnapshotModel::getImage(const QString &tag)
 {
-    if (!m_images.contains(tag)) {
-        QImage img;
-        int size_limit = uiValue("sizeLimit").toInt();
-
-        if (s_cacheableImages.contains(tag)) {
-            // if cacheable - see if we can load it
-            QString path = m_cacheDir.filePath(tag + ".png");
-            if (img.load(path)) {
-                if (tag.endsWith("mask",Qt::CaseInsensitive))
-                    img = img.convertToFormat(QImage::Format_Indexed8, greyTable());
-                else
-                    img = img.convertToFormat(QImage::Format_RGB888);
-            }
+    if (tag == "input" && !m_images.contains(tag)) {
+        // still decoding in the background, wait for it
+        m_inputWatcher.waitForFinished();
+        acceptInput();
+    }
 
-            // see if size is compatible
-            if (s_resizedImages.contains(tag) && !img.isNull() && std::max(img.width(), img.height()) != size_limit)
-                img = QImage();
-        }
-        if (img.isNull()) {
-            if (tag == "input") {
-                QArtm::ScopedTimer("Scaling the input image down");
-                img = QImage( m_originalPath )
-                        .scaled( size_limit, size_limit, Qt::KeepAspectRatio, Qt::SmoothTransformation )
-                        .convertToFormat(QImage::Format_RGB888);
-            }
-        }
+    return m_images.value(tag);
+}
 
-        setImage(tag,img);
-    }
+// runs in a worker thread, so it doesn't touch the model at all
+SnapshotModel::DecodedInput SnapshotModel::readInput(CacheArchivePtr archive, QString path, int size_limit)
+{
+    DecodedInput decoded;
+    decoded.contentHash = archive->contentHash( path );
+    decoded.input = QArtm::CountingEngine::loadInput( archive, decoded.contentHash, path, size_limit );
+    return decoded;
+}
 
-    return m_images[tag];
+// waits for the input if it's still being decoded, the hash comes with it
+QByteArray SnapshotModel::contentHash()
+{
+    if (!m_images.contains("input"))
+        getImage("input");
+    return m_contentHash;
 }
 
 cv::Mat SnapshotModel::getMatrix(const QString &tag)
 {
+    if (tag == "input" && !m_matrices.contains(tag))
+        getImage(tag);
+
     if (!m_matrices.contains(tag)) {
         cv::Mat matrix;
         // create some well known matrices
-        QSize qsz = getImage("input").size();
-        cv::Size inputSize = cv::Size( qsz.width(), qsz.height() );
-
         if (tag == "lab") {
-            cv::Mat input = getMatrix("input");
-            input.convertTo(matrix, CV_32FC3, 1.0/255.0);
-            cv::cvtColor( matrix, matrix, CV_RGB2Lab );
+            matrix = m_archive->readMatrix( contentHash(), "lab", m_sizeLimit );
+            if (matrix.empty()) {
+                matrix = QArtm::CountingEngine::toLab( getMatrix("input") );
+                m_cacheWrites.addFuture( QtConcurrent::run( m_archive.data(), &QArtm::CacheArchive::writeMatrix,
+                                                            contentHash(), QString("lab"), matrix, (quint64)m_sizeLimit ) );
+            }
+        } else if ((tag == "indices" || tag == "dists") && m_classificationArchived
+                   && m_classifiedKey == classificationKey()) {
+            // evicted, the archive has them
+            cv::Mat indices, dists;
+            if (QArtm::CountingEngine::loadClassification( m_archive, contentHash(), m_classifiedKey, indices, dists )) {
+                setMatrix("indices", indices);
+                setMatrix("dists", dists);
+            }
+            return m_matrices.value(tag);
+        } else if (tag == "colorDiff") {
+            // from the count masks as they are, picks and unpicks included
+            showColorDiff();
+            return m_matrices.value(tag);
         } else if (tag.contains(".contours.")) {
-            matrix = cv::Mat(inputSize.height, inputSize.width, CV_8UC1, cv::Scalar(0));
-        } else if (tag == "paletteRGB") {
-            cv::Mat paletteLab = getMatrix("paletteLab");
-            matrix = cv::Mat( paletteLab.rows, 3, CV_32FC1 );
-            cv::cvtColor( cv::Mat(paletteLab.rows, 1, CV_32FC3, paletteLab.data),
-                          cv::Mat(paletteLab.rows, 1, CV_32FC3, matrix.data),
-                          CV_Lab2RGB );
-            matrix.convertTo( matrix, CV_8UC1, 255.0 );
-        } else if (tag == "input") {
-            QImage img = getImage(tag);
-            matrix = cv::Mat( img.height(), img.width(), CV_8UC3, (void*)img.constBits() );
-        } else if (tag == "cacheable_mask") { // <-- FIXME just an example
-            QImage img = getImage(tag);
-            matrix = cv::Mat( img.height(), img.width(), CV_8UC1, (void*)img.constBits() );
+            QSize inputSize = getImage("input").size();
+            matrix = cv::Mat(inputSize.height(), inputSize.width(), CV_8UC1, cv::Scalar(0));
         }
 
         setMatrix(tag, matrix);
     }
-    return m_matrices[tag];
+    return m_matrices.value(tag);
 }
 
 void SnapshotModel::setMatrix(const QString &tag, const cv::Mat &matrix)
 {
-    m_matrices[tag] = matrix;
+    m_matrices.insert(tag, matrix);
 }
 
 void SnapshotModel::setImage(const QString &tag, const QImage &img)
@@ -544,6 +863,7 @@ void SnapshotModel::on_resetLayer_clicked()
         QString name = "train.contours." + m_color;
         clearLayer( name );
         m_matrices.remove( name );
+        m_archive->journal()->clear( contentHash(), name );
     }
     updateViews();
 }
@@ -556,28 +876,13 @@ void SnapshotModel::setMode(SnapshotModel::Mode m)
 
 void SnapshotModel::showPalette()
 {
-    cv::Mat paletteRGB = getMatrix("paletteRGB");
+    cv::Mat paletteRGB = m_engine->paletteRGB();
     QImage palette( paletteRGB.data, paletteRGB.rows, 1, QImage::Format_RGB888 );
     clearLayer("train.palette");
     QGraphicsPixmapItem * gpi = new QGraphicsPixmapItem( QPixmap::fromImage(palette), layer("train.palette") );
     gpi->scale(15,15);
 }
 
-void SnapshotModel::buildFlannRecognizer()
-{
-    cvflann::AutotunedIndexParams params( 0.8, 1, 0, 1.0 );
-    //cvflann::LinearIndexParams params;
-    if (m_flann) delete m_flann;
-    m_flann = new cv::flann::GenericIndex< ColorDistance > (getMatrix("paletteLab"), params);
-
-    QString palette_file = m_parentDir.filePath("palette.png");
-    cv::imwrite( palette_file.toStdString(), cv::Mat(getMatrix("paletteRGB").rows, 1, CV_8UC3, getMatrix("paletteRGB").data) );
-
-    QString flann_file = m_parentDir.filePath("flann.dat");
-    m_flann->save( flann_file.toStdString() );
-
-}
-
 void SnapshotModel::on_trainModeGroup_buttonClicked( QAbstractButton * button )
 {
     setTrainMode( button->text().toLower() );
@@ -683,7 +988,9 @@ void SnapshotModel::clearContours(QRectF rect)
         cv::Mat mask = getMatrix(layerName);
         // erase the polygon from the mask: it's more reliable to flood fill than draw a contour, so
         cv::Point seed = toCv( pi->polygon()[0] );
-        cv::floodFill( mask, seed, cv::Scalar(0), 0, cv::Scalar(), cv::Scalar(), 4 | cv::FLOODFILL_FIXED_RANGE);
+        cv::Rect erased;
+        cv::floodFill( mask, seed, cv::Scalar(0), &erased, cv::Scalar(), cv::Scalar(), 4 | cv::FLOODFILL_FIXED_RANGE);
+        journalEdit( layerName, erased );
         delete pi;
     }
 
@@ -742,6 +1049,7 @@ void SnapshotModel::addContour(const QPolygonF &contour, const QString &name, bo
         std::vector< std::vector< cv::Point > > contours;
         contours.push_back(toCvInt(contour ));
         cv::fillPoly( mask, contours, cv::Scalar(255) );
+        journalEdit( name, cv::boundingRect( contours[0] ) );
     }
 }
 
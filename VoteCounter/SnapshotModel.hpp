@@ -3,9 +3,14 @@
 
 #include <QtCore>
 #include <QtGui>
-#include <opencv2/flann/flann.hpp>
+
+#include "MatrixRegistry.hpp"
+#include "CountingEngine.hpp"
 
 class MouseLogic;
+namespace QArtm { class Throttle; class CacheArchive; }
+typedef QSharedPointer< QArtm::CacheArchive > CacheArchivePtr;
+typedef QSharedPointer< const QArtm::CountingEngine > CountingEnginePtr;
 
 typedef QSet< QString > QStringSet;
 
@@ -25,9 +30,16 @@ public:
         POLYGONS_CONTOUR
     };
 
-    static const int COLOR_GRADATIONS = 5;
+    // bytes of matrices kept while shown and while parked in the shell's cache
+    static const qint64 ACTIVE_MATRIX_BUDGET = 512 * 1024 * 1024;
+    static const qint64 PARKED_MATRIX_BUDGET = 16 * 1024 * 1024;
+
+    // one complete count, never changed once published: the gui reads the
+    // current one while a worker builds the next
+    typedef QArtm::CountingEngine::Result CountResult;
+    typedef QSharedPointer< const CountResult > CountResultPtr;
 
-    explicit SnapshotModel(const QString& path, QObject *parent);
+    explicit SnapshotModel(const QString& path, CacheArchivePtr archive, QObject *parent);
     ~SnapshotModel();
 
     QImage getImage(const QString& tag);
@@ -36,9 +48,24 @@ public:
     void setMatrix(const QString& tag, const cv::Mat& matrix);
 
     QGraphicsScene * scene() { return m_scene; }
+    const QString& path() const { return m_originalPath; }
+    // cards found of each color, in s_colorNames order
+    QVector<int> counts();
+
+    // an inactive snapshot is kept in memory but doesn't listen to the ui
+    void setActive(bool active);
+    // whether it was loaded with the current settings and can be shown again
+    bool isCurrent();
+    // kilobytes held by matrices and images
+    int memoryCost() const;
+
 signals:
     void willCount();
+    void countProgress(int doneTiles, int totalTiles);
     void doneCounting();
+    void tileClassified(QRect tile, int generation);
+    void countCancelled();
+    void paletteLearned();
 
 public slots:
     void setMode(Mode m);
@@ -64,19 +91,26 @@ public slots:
     void on_mouseLogic_rectUpdated(QRectF rect, Qt::MouseButton button, Qt::KeyboardModifiers mods);
     void on_mouseLogic_rectSelected(QRectF rect, Qt::MouseButton button, Qt::KeyboardModifiers mods);
     void on_countWatcher_finished();
+    void on_inputWatcher_finished();
     void on_commit_clicked();
     void on_http_finished( QNetworkReply * reply );
 
+    void mergeClassifiedTile(QRect tile, int generation);
+    // stops the count in progress at the next tile, nothing it does after is used
+    void cancelCount(bool wait = false);
+
 protected:
-    static QStringSet s_cacheableImages;
-    static QStringSet s_resizedImages;
     static QStringList s_colorNames;
     static QStringList s_persistentMasks;
 
     QString m_originalPath;
-    QDir m_parentDir, m_cacheDir;
+    QDir m_parentDir;
+    CacheArchivePtr m_archive;
+    // content hash of the original, addresses everything cached in the archive;
+    // it's computed with the input in the background, see contentHash()
+    QByteArray m_contentHash;
     QMap< QString, QImage > m_images;
-    QMap< QString, cv::Mat > m_matrices;
+    QArtm::MatrixRegistry m_matrices;
 
     QGraphicsScene * m_scene;
     MouseLogic * m_mouseLogic;
@@ -88,24 +122,83 @@ protected:
     QMap< QString, QGraphicsItem *> m_layers;
     bool m_showColorDiff;
 
-    typedef float ColorType;
-    typedef cv::flann::L2<ColorType> ColorDistance;
-    cv::flann::GenericIndex< ColorDistance > * m_flann;
+    // the directory's palette and classifier, replaced whenever it's (re)learned
+    CountingEnginePtr m_engine;
 
-    QFutureWatcher<void> m_countWatcher;
+    QFutureWatcher<CountResultPtr> m_countWatcher;
+    struct DecodedInput {
+        QByteArray contentHash;
+        cv::Mat input;
+    };
+    QFutureWatcher<DecodedInput> m_inputWatcher;
+    QFutureSynchronizer<bool> m_cacheWrites;
+    int m_sizeLimit;
+    QGraphicsPixmapItem * m_inputItem;
+    bool m_countRequested;
+    bool m_active;
+    // what the classification in memory and the cards on the scene were computed for
+    quint64 m_classifiedKey, m_countedKey;
+    // the archive has the classification of m_classifiedKey
+    bool m_classificationArchived;
+    // classification buffers owned by the counting worker, tiles are merged
+    // into "indices" and "dists" on the gui thread as they complete
+    cv::Mat m_workIndices, m_workDists;
+    QList< cv::Rect > m_countTiles;
+    int m_tilesDone;
+    // every count gets a generation, bumping it cancels the running one;
+    // workers check it between tiles and their stale tiles are ignored
+    QAtomicInt m_countGeneration;
+    int m_countingGeneration;
+    quint64 m_countingKey;
+    QFutureSynchronizer<CountResultPtr> m_countTasks;
+    // the last complete count
+    CountResultPtr m_result;
+
+    // everything a counting worker needs, so it doesn't touch our state
+    struct CountJob {
+        CountingEnginePtr engine;
+        int generation;
+        quint64 key;
+        int threshold, sizeFilter;
+        CacheArchivePtr archive;
+        QByteArray hash;
+        // indices and dists are either a complete classification or the
+        // buffers the tiles of lab are classified into
+        bool classified;
+        // and that the archive has them
+        bool archived;
+        cv::Mat lab, indices, dists;
+        QList< cv::Rect > tiles;
+        // unchanged tiles are copied from the previous photo's classification
+        cv::Mat fingerprints;
+        QArtm::CountingEngine::Reference reference;
+    };
+    QArtm::Throttle * m_partialThrottle;
 
     QNetworkAccessManager * m_networkManager;
 
     void updateViews();
+    void acceptInput();
+    static DecodedInput readInput(CacheArchivePtr archive, QString path, int size_limit);
+    QByteArray contentHash();
     void saveData();
     void loadData();
+    void journalEdit(const QString& name, const cv::Rect& roi);
+    void saveContours(const QString& name);
+    bool loadContours(const QString& name);
     QGraphicsItem * layer(const QString& name);
     void showPalette();
-    void buildFlannRecognizer();
 
-    void classifyPixels();
+    CountResultPtr runCount(CountJob job);
+    void publishResult(CountResultPtr result);
+    quint64 classificationKey() const;
+    quint64 countKey();
+    void evictMatrices();
+    QList< cv::Rect > countingTiles(const cv::Size& size, const QPointF& focus);
     void computeColorDiff();
+    void showColorDiff();
     void countCards();
+    void showCards(const QString& layerName, const std::vector< std::vector< cv::Point > >& contours);
 
     void addContour(const QPolygonF& contour, const QString& name, bool paintToMask = false);
     void floodPickContour(int x, int y, int fuzz, const QString& layerName);
@@ -1,10 +1,13 @@
 #include "VoteCounterShell.hpp"
 #include "SnapshotModel.hpp"
+#include "SnapshotCatalogue.hpp"
+#include "SnapshotDelegate.hpp"
+#include "SnapshotIngest.hpp"
 #include "ScopedDetention.hpp"
+#include "CacheArchive.hpp"
 
 #include <QDir>
 #include <QListWidget>
-#include <QFileSystemModel>
 #include <QGraphicsView>
 #include <QRadioButton>
 #include <QButtonGroup>
@@ -14,26 +17,53 @@ QStringList() << "sizeLimit"
               << "pickFuzz"
               << "colorDiffThreshold"
               << "sizeFilter"
-              << "heckleUrl";
+              << "heckleUrl"
+              << "recountAll"
+              << "latencyBudget";
 
 VoteCounterShell::VoteCounterShell(QWidget *parent) :
     QMainWindow(parent),
     m_snapshot(0),
+    m_snapshotCache(SNAPSHOT_CACHE_KB),
     m_lastWorkMode(0),
-    m_fsModel(new QFileSystemModel( this ))
+    m_catalogue(new SnapshotCatalogue( this )),
+    m_ingest(new SnapshotIngest( QThread::LowestPriority, this )),
+    // new arrivals go first
+    m_recount(new SnapshotIngest( QThread::IdlePriority, this )),
+    m_recountTotal(0),
+    m_recountDone(0),
+    m_quickCount(new QFutureWatcher< QuickCount >( this ))
 {
-    m_fsModel->setObjectName("fsModel");
-
-    m_waitDialog = new QMessageBox(this);
-    m_waitDialog->setWindowTitle("Counting...");
-    m_waitDialog->setText("Please wait while we count the cards");
-    m_waitDialog->setStandardButtons(QMessageBox::NoButton);
-    m_waitDialog->setWindowModality(Qt::WindowModal);
+    m_catalogue->setObjectName("catalogue");
+    m_ingest->setObjectName("ingest");
+    m_recount->setObjectName("recount");
+    m_quickCount->setObjectName("quickCount");
+
+    // partial counts are shown while counting, so only a progress bar here
+    m_countProgress = new QProgressBar(this);
+    m_countProgress->setFormat("Counting %p%");
+    m_countProgress->setMaximumWidth(200);
+    m_countProgress->hide();
+    statusBar()->addPermanentWidget(m_countProgress);
+
+    m_recountProgress = new QProgressBar(this);
+    m_recountProgress->setFormat("Recounting %v/%m");
+    m_recountProgress->setMaximumWidth(200);
+    m_recountProgress->hide();
+    statusBar()->addPermanentWidget(m_recountProgress);
+    m_recountPause = new QToolButton(this);
+    m_recountPause->setObjectName("recountPause");
+    m_recountPause->setText("Pause");
+    m_recountPause->setCheckable(true);
+    m_recountPause->hide();
+    statusBar()->addPermanentWidget(m_recountPause);
 }
 
 VoteCounterShell::~VoteCounterShell()
 {
     saveSettings();
+    m_quickCount->waitForFinished();
+    m_snapshotCache.clear();
     if (m_snapshot)
         delete m_snapshot;
 }
@@ -57,6 +87,10 @@ void VoteCounterShell::loadSettings()
             QVariant value = m_settings.value(name);
             if (value.isValid())
                 o->setProperty("value", value);
+        } else if (qobject_cast<QAbstractButton*>(o)) {
+            QVariant value = m_settings.value(name);
+            if (value.isValid())
+                o->setProperty("checked", value);
         } else if ((o->metaObject()->indexOfProperty("text") >= 0)) {
             QVariant value = m_settings.value(name);
             if (value.isValid())
@@ -79,6 +113,8 @@ void VoteCounterShell::saveSettings()
         if ((o->metaObject()->indexOfProperty("value") >= 0)
                 || (o->dynamicPropertyNames().contains("value"))) {
             m_settings.setValue(name, o->property("value"));
+        } else if (qobject_cast<QAbstractButton*>(o)) {
+            m_settings.setValue(name, o->property("checked"));
         } else if ((o->metaObject()->indexOfProperty("text") >= 0)) {
             m_settings.setValue(name, o->property("text"));
         }
@@ -116,17 +152,27 @@ void VoteCounterShell::loadDir(const QString &path)
 
     // load the file list
     QListView * list = findChild<QListView*>("snapsList");
+    // one cache archive per event directory, shared by all its snapshots
+    if (!path.isEmpty()) {
+        dropCachedSnapshots();
+        m_archive = CacheArchivePtr( new QArtm::CacheArchive );
+        m_archive->open( QDir(path).filePath("cache.vca") );
+        m_ingest->setDirectory( path, m_archive );
+        m_recount->setDirectory( path, m_archive );
+        m_recountTotal = m_recountDone = 0;
+        m_recountProgress->hide();
+        m_recountPause->hide();
+    }
+
     if (list) {
-        m_fsModel->setRootPath( path );
-        list->setModel(m_fsModel);
-        list->setRootIndex(m_fsModel->index(path));
-        m_fsModel->setFilter( QDir::Files );
-        m_fsModel->setNameFilters( QStringList() << "*.jpg" << "*.JPG"  );
-        m_fsModel->setNameFilterDisables(false);
+        if (!qobject_cast<SnapshotDelegate*>(list->itemDelegate()))
+            list->setItemDelegate( new SnapshotDelegate(list) );
+        list->setModel(m_catalogue);
+        m_catalogue->setDirectory( path );
     }
 }
 
-void VoteCounterShell::on_fsModel_directoryLoaded(QString path)
+void VoteCounterShell::on_catalogue_updated()
 {
     QListView * list = findChild<QListView*>("snapsList");
     int minlistw = list->sizeHintForColumn(0);
@@ -135,32 +181,141 @@ void VoteCounterShell::on_fsModel_directoryLoaded(QString path)
     QSplitter * splitter = findChild<QSplitter*>("splitter");
     splitter->setSizes( QList<int>() << minlistw << splitter->width() - minlistw - splitter->handleWidth() );
 
-    m_fsModel->sort(3, Qt::DescendingOrder); // newest first
-    QModelIndex newest = m_fsModel->index(0, 0, list->rootIndex());
+    QModelIndex newest = m_catalogue->index(0); // catalogue keeps newest first
 
     if ( newest.data().toString() != m_lastNewest ) {
         m_lastNewest = newest.data().toString();
         list->setCurrentIndex(newest);
-        on_snapsList_clicked(newest);
+        if (!startQuickCount( newest.data( SnapshotCatalogue::PathRole ).toString() ))
+            on_snapsList_clicked(newest);
     }
 }
 
-void VoteCounterShell::on_snapsList_clicked( const QModelIndex & index )
+// false if there's no deadline or nothing to count with yet
+bool VoteCounterShell::startQuickCount(const QString &path)
+{
+    int budget = findChild<QObject*>("latencyBudget")->property("value").toInt();
+    CountingEnginePtr engine = m_ingest->engine();
+    if (budget <= 0 || !engine)
+        return false;
+
+    QArtm::CountingEngine::Parameters full;
+    full.sizeLimit = findChild<QObject*>("sizeLimit")->property("value").toInt();
+    full.threshold = findChild<QObject*>("colorDiffThreshold")->property("value").toInt();
+    full.sizeFilter = findChild<QObject*>("sizeFilter")->property("value").toInt();
+    QArtm::DeadlinePlanner::Plan plan = m_planner.plan( budget, full );
+    qDebug() << qPrintable( QString("Deadline %1 ms for %2: %3")
+                            .arg(budget).arg(QFileInfo(path).fileName()).arg(plan.toString()) );
+
+    // a newer one takes over, the previous result is dropped when it comes
+    m_quickPath = path;
+    m_quickCount->setFuture( QtConcurrent::run( &VoteCounterShell::runQuickCount, engine,
+                                                plan.refine ? CacheArchivePtr() : m_archive,
+                                                path, plan ) );
+    return true;
+}
+
+// Only a count with the full parameters is worth caching, the cheaper ones
+// are thrown away once the refinement is in
+VoteCounterShell::QuickCount VoteCounterShell::runQuickCount(CountingEnginePtr engine, CacheArchivePtr archive,
+                                                             QString path, QArtm::DeadlinePlanner::Plan plan)
+{
+    QuickCount quick;
+    quick.path = path;
+    quick.plan = plan;
+    QTime time;
+    time.start();
+    quick.result = engine->count( archive, path, plan.parameters );
+    quick.elapsed = time.elapsed();
+    quick.counts = quick.result.counts();
+    return quick;
+}
+
+void VoteCounterShell::on_quickCount_finished()
 {
-    QString snap = index.data( ).toString();
-    QString dir = m_settings.value("snaps_dir").toString();
-    loadSnapshot( dir + "/" + snap);
+    QuickCount quick = m_quickCount->result();
+    m_planner.record( quick.plan.parameters, quick.result );
+    if (quick.path != m_quickPath)
+        return;
+    m_quickPath.clear();
+
+    QString name = QFileInfo(quick.path).fileName();
+    qDebug() << qPrintable( QString("Quick count of %1 took %2 ms, %3 predicted")
+                            .arg(name).arg(quick.elapsed).arg(quick.plan.predicted) );
+    if (!quick.counts.isEmpty()) {
+        m_catalogue->setCounts( name, quick.counts );
+        QStringList counts;
+        foreach(int count, quick.counts)
+            counts << QString::number(count);
+        statusBar()->showMessage( QString("%1: %2 in %3 ms at %4px%5")
+                                  .arg(name).arg(counts.join(" / ")).arg(quick.elapsed)
+                                  .arg(quick.plan.parameters.sizeLimit)
+                                  .arg(quick.plan.refine ? ", refining" : "") );
+    }
 
-    connect(m_snapshot, SIGNAL(willCount()), SLOT(willCount()));
-    connect(m_snapshot, SIGNAL(doneCounting()), SLOT(doneCounting()));
+    // opening it counts it with the full parameters, unless it's been superseded
+    int row = m_catalogue->row(name);
+    if (row >= 0 && name == m_lastNewest)
+        on_snapsList_clicked( m_catalogue->index(row) );
+}
+
+// the newest one is about to be opened anyway, the others get
+// counted in the background, newest first
+void VoteCounterShell::on_catalogue_arrived(const QStringList &paths)
+{
+    QString newest = m_catalogue->index(0).data( SnapshotCatalogue::PathRole ).toString();
+    int sizeLimit = findChild<QObject*>("sizeLimit")->property("value").toInt();
+    int threshold = findChild<QObject*>("colorDiffThreshold")->property("value").toInt();
+    int sizeFilter = findChild<QObject*>("sizeFilter")->property("value").toInt();
+    for(int i = paths.size() - 1; i >= 0; i--) {
+        if (paths[i] != newest)
+            m_ingest->enqueue( paths[i], sizeLimit, threshold, sizeFilter );
+    }
+}
+
+void VoteCounterShell::on_ingest_ingested(const QString &path, const QVector<int> &counts)
+{
+    QString name = QFileInfo(path).fileName();
+    m_catalogue->addCacheState( name, SnapshotRecord::CACHED );
+    if (!counts.isEmpty())
+        m_catalogue->setCounts( name, counts );
+}
+
+void VoteCounterShell::on_snapsList_clicked( const QModelIndex & index )
+{
+    loadSnapshot( index.data( SnapshotCatalogue::PathRole ).toString() );
 
     findChild<QPushButton*>("count")->animateClick();
 }
 
 void VoteCounterShell::loadSnapshot(const QString &path)
 {
-    if (m_snapshot) delete m_snapshot;
-    m_snapshot = new SnapshotModel(path, this);
+    // keep the one we're leaving around, going back to it is free
+    if (m_snapshot) {
+        m_snapshot->setActive(false);
+        m_snapshotCache.insert( m_snapshot->path(), m_snapshot, m_snapshot->memoryCost() );
+        m_snapshot = 0;
+    }
+
+    m_snapshot = m_snapshotCache.take(path);
+    if (m_snapshot && !m_snapshot->isCurrent()) {
+        delete m_snapshot;
+        m_snapshot = 0;
+    }
+
+    if (m_snapshot) {
+        qDebug() << "Reusing" << qPrintable(path) << "from memory," << m_snapshotCache.count()
+                 << "more snapshots cached in" << m_snapshotCache.totalCost() / 1024 << "MB";
+        m_snapshot->setActive(true);
+    } else {
+        m_snapshot = new SnapshotModel(path, m_archive, this);
+        connect(m_snapshot, SIGNAL(willCount()), SLOT(willCount()));
+        connect(m_snapshot, SIGNAL(countProgress(int,int)), SLOT(countProgress(int,int)));
+        connect(m_snapshot, SIGNAL(doneCounting()), SLOT(doneCounting()));
+        connect(m_snapshot, SIGNAL(countCancelled()), SLOT(countCancelled()));
+        connect(m_snapshot, SIGNAL(paletteLearned()), SLOT(paletteLearned()));
+    }
+    m_catalogue->addCacheState( QFileInfo(path).fileName(), SnapshotRecord::CACHED );
 
     QGraphicsView * display = findChild<QGraphicsView*>("display");
     display->setScene( m_snapshot->scene() );
@@ -220,10 +375,106 @@ void VoteCounterShell::recallLastWorkMode()
 
 void VoteCounterShell::willCount()
 {
-    m_waitDialog->show();
+    if (sender() != m_snapshot)
+        return;
+    m_countProgress->setValue(0);
+    m_countProgress->show();
+}
+
+void VoteCounterShell::countProgress(int doneTiles, int totalTiles)
+{
+    if (sender() != m_snapshot)
+        return;
+    m_countProgress->setMaximum(totalTiles);
+    m_countProgress->setValue(doneTiles);
 }
 
 void VoteCounterShell::doneCounting()
 {
-    m_waitDialog->hide();
+    // cached snapshots may finish counting in the background
+    SnapshotModel * snapshot = qobject_cast<SnapshotModel*>( sender() );
+    if (!snapshot)
+        return;
+    if (snapshot == m_snapshot)
+        m_countProgress->hide();
+    m_catalogue->setCounts( QFileInfo(snapshot->path()).fileName(), snapshot->counts() );
+}
+
+void VoteCounterShell::countCancelled()
+{
+    if (sender() == m_snapshot)
+        m_countProgress->hide();
+}
+
+void VoteCounterShell::paletteLearned()
+{
+    m_ingest->reloadEngine();
+    m_recount->reloadEngine();
+    dropCachedSnapshots();
+    QAbstractButton * recount = findChild<QAbstractButton*>("recountAll");
+    if (recount && recount->isChecked())
+        recountAll();
+}
+
+// they were classified with another palette or belong to another directory
+void VoteCounterShell::dropCachedSnapshots()
+{
+    m_snapshotCache.clear();
+}
+
+void VoteCounterShell::recountAll()
+{
+    // a recount in progress is stale too
+    m_recount->clear();
+
+    int sizeLimit = findChild<QObject*>("sizeLimit")->property("value").toInt();
+    int threshold = findChild<QObject*>("colorDiffThreshold")->property("value").toInt();
+    int sizeFilter = findChild<QObject*>("sizeFilter")->property("value").toInt();
+    // the catalogue keeps newest first
+    m_recountTotal = m_catalogue->rowCount();
+    m_recountDone = 0;
+    for(int r = 0; r < m_recountTotal; r++)
+        m_recount->enqueue( m_catalogue->index(r).data( SnapshotCatalogue::PathRole ).toString(),
+                            sizeLimit, threshold, sizeFilter );
+
+    qDebug() << "Recounting" << m_recountTotal << "snapshots with the new palette";
+    m_recountProgress->setMaximum( qMax(1, m_recountTotal) );
+    m_recountProgress->setValue(0);
+    m_recountProgress->setVisible( m_recountTotal > 0 );
+    m_recountPause->setVisible( m_recountTotal > 0 );
+}
+
+void VoteCounterShell::on_recount_ingested(const QString &path, const QVector<int> &counts)
+{
+    QString name = QFileInfo(path).fileName();
+    m_catalogue->addCacheState( name, SnapshotRecord::CACHED );
+    if (!counts.isEmpty())
+        m_catalogue->setCounts( name, counts, true );
+    recountStepped();
+}
+
+void VoteCounterShell::on_recount_failed(const QString &)
+{
+    recountStepped();
+}
+
+// one more photo recounted or given up on; the ones of a superseded
+// recount aren't reported by m_recount
+void VoteCounterShell::recountStepped()
+{
+    m_recountDone++;
+    m_recountProgress->setValue( qMin(m_recountDone, m_recountTotal) );
+    if (m_recountDone >= m_recountTotal) {
+        m_recountProgress->hide();
+        m_recountPause->hide();
+        m_recountPause->setChecked(false);
+        qDebug() << "Recounted" << m_recountTotal << "snapshots";
+        qDebug() << qPrintable( m_recount->report() );
+    }
+}
+
+void VoteCounterShell::on_recountPause_toggled(bool paused)
+{
+    m_recount->setPaused(paused);
+    m_recountPause->setText( paused ? "Resume" : "Pause" );
 }
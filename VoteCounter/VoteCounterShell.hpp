@@ -3,7 +3,11 @@
 
 #include <QMainWindow>
 
-class SnapshotModel;
+#include "SnapshotModel.hpp"
+#include "DeadlinePlanner.hpp"
+
+class SnapshotCatalogue;
+class SnapshotIngest;
 
 class VoteCounterShell : public QMainWindow
 {
@@ -22,23 +26,65 @@ public slots:
     void recallLastWorkMode();
 
     void willCount();
+    void countProgress(int doneTiles, int totalTiles);
     void doneCounting();
+    void countCancelled();
+    void paletteLearned();
+    void dropCachedSnapshots();
+    // counts every snapshot of the directory again in the background, newest first
+    void recountAll();
 
     // automatically connected slots for children's signals
     void on_snapDirPicker_clicked();
     void on_snapsList_clicked ( const QModelIndex & index );
     void on_mode_currentChanged( int index );
-    void on_fsModel_directoryLoaded(QString path);
+    void on_catalogue_updated();
+    void on_catalogue_arrived(const QStringList& paths);
+    void on_ingest_ingested(const QString& path, const QVector<int>& counts);
+    void on_recount_ingested(const QString& path, const QVector<int>& counts);
+    void on_recount_failed(const QString& path);
+    void on_recountPause_toggled(bool paused);
+    void on_quickCount_finished();
 
 protected:
     SnapshotModel * m_snapshot;
+    // recently shown snapshots by path, costs in kilobytes
+    QCache< QString, SnapshotModel > m_snapshotCache;
     int m_lastWorkMode;
     QSettings m_settings;
-    QFileSystemModel * m_fsModel;
-    QMessageBox * m_waitDialog;
+    SnapshotCatalogue * m_catalogue;
+    SnapshotIngest * m_ingest;
+    // same pipeline at a lower priority, for recounting after the palette changed
+    SnapshotIngest * m_recount;
+    int m_recountTotal, m_recountDone;
+    QProgressBar * m_recountProgress;
+    QToolButton * m_recountPause;
+    void recountStepped();
+    CacheArchivePtr m_archive;
+    QProgressBar * m_countProgress;
     QString m_lastNewest;
 
+    // with a latency budget the newest snapshot gets a planned count first,
+    // opening it afterwards is the refinement
+    struct QuickCount {
+        QString path;
+        QArtm::DeadlinePlanner::Plan plan;
+        QVector<int> counts;
+        int elapsed;
+        // the planner learns from it on the gui thread
+        QArtm::CountingEngine::Result result;
+        QuickCount() : elapsed(0) {}
+    };
+    QArtm::DeadlinePlanner m_planner;
+    QFutureWatcher< QuickCount > * m_quickCount;
+    QString m_quickPath;
+
+    bool startQuickCount(const QString& path);
+    static QuickCount runQuickCount(CountingEnginePtr engine, CacheArchivePtr archive, QString path,
+                                    QArtm::DeadlinePlanner::Plan plan);
+
     static QStringList s_persistentObjectNames;
+    static const int SNAPSHOT_CACHE_KB = 768 * 1024;
 
     virtual bool eventFilter(QObject *, QEvent *);
     QSet<QEvent*> m_eventFilterSentinel;
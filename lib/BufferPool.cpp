@@ -0,0 +1,145 @@
+#include "BufferPool.hpp"
+
+using namespace QArtm;
+
+// the whole process shares it and matrices may outlive main(), so it's never deleted
+BufferPool * BufferPool::instance()
+{
+    static BufferPool * s_instance = new BufferPool( 256 * 1024 * 1024 );
+    return s_instance;
+}
+
+BufferPool::BufferPool( qint64 limit )
+    : m_limit(limit)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    trim();
+}
+
+cv::Mat BufferPool::matrix( int rows, int cols, int type )
+{
+    cv::Mat m;
+    m.allocator = this;
+    m.create( rows, cols, type );
+    return m;
+}
+
+cv::Mat BufferPool::matrix( int rows, int cols, int type, const cv::Scalar& value )
+{
+    cv::Mat m = matrix( rows, cols, type );
+    m.setTo( value );
+    return m;
+}
+
+QByteArray BufferPool::shapeKey( int dims, const int * sizes, int type )
+{
+    QByteArray key;
+    QDataStream out( &key, QIODevice::WriteOnly );
+    out << (qint32)CV_MAT_TYPE(type);
+    for(int i = 0; i < dims; i++)
+        out << (qint32)sizes[i];
+    return key;
+}
+
+void BufferPool::allocate( int dims, const int * sizes, int type, int *& refcount,
+                           uchar *& datastart, uchar *& data, size_t * step )
+{
+    size_t elemSize = CV_ELEM_SIZE(type);
+    step[dims-1] = elemSize;
+    for(int i = dims - 1; i > 0; i--)
+        step[i-1] = step[i] * sizes[i];
+    qint64 size = (qint64)step[0] * sizes[0];
+
+    QByteArray key = shapeKey( dims, sizes, type );
+    Buffer buffer;
+
+    QMutexLocker locker(&m_lock);
+    m_stats.requests++;
+    QHash< QByteArray, QList< Buffer > >::iterator it = m_free.find(key);
+    if (it != m_free.end() && !it->isEmpty()) {
+        buffer = it->takeLast();
+        m_stats.hits++;
+        m_stats.pooled--;
+        m_stats.pooledBytes -= buffer.size;
+    } else {
+        locker.unlock();
+        buffer.data = (uchar *)cv::fastMalloc( size );
+        buffer.refcount = new int;
+        buffer.size = size;
+        locker.relock();
+    }
+
+    m_live[buffer.data] = qMakePair( key, buffer );
+    m_stats.live++;
+    m_stats.liveBytes += buffer.size;
+
+    *buffer.refcount = 1;
+    refcount = buffer.refcount;
+    datastart = data = buffer.data;
+}
+
+void BufferPool::deallocate( int *, uchar * datastart, uchar * )
+{
+    QMutexLocker locker(&m_lock);
+    QPair< QByteArray, Buffer > live = m_live.take(datastart);
+    m_stats.live--;
+    m_stats.liveBytes -= live.second.size;
+
+    if (m_stats.pooledBytes + live.second.size > m_limit) {
+        locker.unlock();
+        release( live.second );
+        return;
+    }
+    m_free[live.first] << live.second;
+    m_stats.pooled++;
+    m_stats.pooledBytes += live.second.size;
+}
+
+void BufferPool::release( const Buffer& buffer )
+{
+    cv::fastFree( buffer.data );
+    delete buffer.refcount;
+}
+
+void BufferPool::setLimit( qint64 bytes )
+{
+    {
+        QMutexLocker locker(&m_lock);
+        m_limit = bytes;
+        if (m_stats.pooledBytes <= m_limit)
+            return;
+    }
+    trim();
+}
+
+void BufferPool::trim()
+{
+    QHash< QByteArray, QList< Buffer > > free;
+    {
+        QMutexLocker locker(&m_lock);
+        free.swap(m_free);
+        m_stats.pooled = 0;
+        m_stats.pooledBytes = 0;
+    }
+    foreach(const QList< Buffer >& buffers, free)
+        foreach(const Buffer& buffer, buffers)
+            release(buffer);
+}
+
+BufferPool::Stats BufferPool::stats() const
+{
+    QMutexLocker locker(&m_lock);
+    return m_stats;
+}
+
+QString BufferPool::report() const
+{
+    Stats s = stats();
+    return QString("Buffer pool: %1 requests, %2% hits, %3 live (%4 KB), %5 pooled (%6 KB)")
+            .arg( s.requests ).arg( s.hitRate() * 100.0, 0, 'f', 1 )
+            .arg( s.live ).arg( s.liveBytes / 1024 )
+            .arg( s.pooled ).arg( s.pooledBytes / 1024 );
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+namespace QArtm {
+
+// Recycles matrix buffers by shape and type. Matrices made by matrix()
+// hand their buffer back to the pool when the last reference goes, and
+// the next request of the same shape and type gets it without a trip to
+// the heap. One pool is shared by all snapshots and threads, since they
+// all work at the same size limit and tile size.
+class BufferPool : public cv::MatAllocator {
+public:
+    struct Stats {
+        quint64 requests, hits;
+        int live, pooled;
+        qint64 liveBytes, pooledBytes;
+        Stats() : requests(0), hits(0), live(0), pooled(0), liveBytes(0), pooledBytes(0) {}
+        double hitRate() const { return requests ? (double)hits / requests : 0.0; }
+    };
+
+    static BufferPool * instance();
+
+    explicit BufferPool( qint64 limit );
+    ~BufferPool();
+
+    cv::Mat matrix( int rows, int cols, int type );
+    cv::Mat matrix( int rows, int cols, int type, const cv::Scalar& value );
+
+    // buffers kept for reuse beyond this are freed right away
+    void setLimit( qint64 bytes );
+    void trim();
+
+    Stats stats() const;
+    QString report() const;
+
+    void allocate( int dims, const int * sizes, int type, int *& refcount,
+                   uchar *& datastart, uchar *& data, size_t * step );
+    void deallocate( int * refcount, uchar * datastart, uchar * data );
+
+protected:
+    struct Buffer {
+        uchar * data;
+        int * refcount;
+        qint64 size;
+    };
+
+    mutable QMutex m_lock;
+    qint64 m_limit;
+    QHash< QByteArray, QList< Buffer > > m_free;
+    QHash< uchar *, QPair< QByteArray, Buffer > > m_live;
+    Stats m_stats;
+
+    static QByteArray shapeKey( int dims, const int * sizes, int type );
+    void release( const Buffer& buffer );
+};
+
+}
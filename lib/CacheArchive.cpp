@@ -0,0 +1,476 @@
+#include "CacheArchive.hpp"
+#include "MatrixFile.hpp"
+#include "MatrixJournal.hpp"
+
+#ifdef Q_OS_UNIX
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace QArtm;
+
+// compact once superseded records take more than half of a file this big
+static const qint64 COMPACTION_THRESHOLD = 64 * 1024 * 1024;
+
+QDataStream& operator<<( QDataStream& out, const CacheArchive::Entry& entry )
+{
+    return out << entry.offset << entry.size;
+}
+
+QDataStream& operator>>( QDataStream& in, CacheArchive::Entry& entry )
+{
+    return in >> entry.offset >> entry.size;
+}
+
+CacheArchive::CacheArchive()
+    : m_readOnly(false),
+      m_garbage(0),
+      m_fileId(0),
+      m_scanned(0),
+      m_compactionFailedAt(-1)
+{
+}
+
+CacheArchive::~CacheArchive()
+{
+    close();
+}
+
+bool CacheArchive::open( const QString& path )
+{
+    close();
+
+    QMutexLocker locker(&m_lock);
+    m_path = path;
+    m_readOnly = !lock();
+    if (m_readOnly)
+        qWarning() << "Cache archive" << path << "is being written by another process, opening it read only";
+    m_file.setFileName(path);
+    if (!m_file.open( m_readOnly ? QIODevice::ReadOnly : QIODevice::ReadWrite )) {
+        qWarning() << "Can't open cache archive" << path << m_file.errorString();
+        return false;
+    }
+
+    m_fileId = fileId(m_file);
+    loadIndex();
+    locker.unlock();
+
+    m_journal.reset( new MatrixJournal( this, path + ".journal" ) );
+    return true;
+}
+
+void CacheArchive::close()
+{
+    // pending checkpoints still write into the archive
+    m_journal.reset();
+    m_compaction.waitForFinished();
+
+    QMutexLocker locker(&m_lock);
+    if (m_file.isOpen()) {
+        if (!m_readOnly)
+            saveIndex();
+        m_file.close();
+    }
+    // the lock goes with its descriptor
+    m_lockFile.close();
+    m_readOnly = false;
+    m_index.clear();
+    m_verified.clear();
+    m_garbage = 0;
+    m_fileId = 0;
+    m_scanned = 0;
+    m_compactionFailedAt = -1;
+}
+
+// flock is advisory and per open file, so it covers other processes only;
+// within one process a single CacheArchive is shared
+bool CacheArchive::lock()
+{
+    m_lockFile.setFileName( m_path + ".lock" );
+    if (!m_lockFile.open(QIODevice::ReadWrite)) {
+        qWarning() << "Can't open" << m_lockFile.fileName() << m_lockFile.errorString();
+        return false;
+    }
+#ifdef Q_OS_UNIX
+    if (flock( m_lockFile.handle(), LOCK_EX | LOCK_NB ) != 0) {
+        m_lockFile.close();
+        return false;
+    }
+#endif
+    return true;
+}
+
+QString CacheArchive::recordKey( const QByteArray& hash, const QString& name )
+{
+    return QString::fromAscii( hash.toHex() ) + "/" + name;
+}
+
+qint64 CacheArchive::aligned( qint64 offset )
+{
+    return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+// of the open file, or of the one at its path; 0 where there are no inodes
+quint64 CacheArchive::fileId( const QFile& file )
+{
+#ifdef Q_OS_UNIX
+    struct stat st;
+    int result = file.isOpen() ? fstat( file.handle(), &st )
+                               : stat( QFile::encodeName( file.fileName() ).constData(), &st );
+    return result == 0 ? st.st_ino : 0;
+#else
+    Q_UNUSED(file);
+    return 0;
+#endif
+}
+
+// the writing process appends and compacts behind a read only archive's
+// back; called locked
+void CacheArchive::refresh()
+{
+    if (!m_readOnly || !m_file.isOpen())
+        return;
+
+    QFile current(m_path);
+    if (fileId(current) != m_fileId) {
+        m_file.close();
+        m_verified.clear();
+        if (!m_file.open(QIODevice::ReadOnly)) {
+            qWarning() << "Can't reopen cache archive" << m_path << m_file.errorString();
+            m_index.clear();
+            return;
+        }
+        m_fileId = fileId(m_file);
+        loadIndex();
+    } else if (m_file.size() > m_scanned) {
+        m_scanned = scan(m_scanned);
+    }
+}
+
+qint64 CacheArchive::size() const
+{
+    QMutexLocker locker(&m_lock);
+    return m_file.size();
+}
+
+qint64 CacheArchive::garbage() const
+{
+    QMutexLocker locker(&m_lock);
+    return m_garbage;
+}
+
+QByteArray CacheArchive::contentHash( const QString& sourcePath )
+{
+    QFileInfo fi(sourcePath);
+    // the identity isn't a content hash itself, but it's what we know without reading the file
+    QByteArray identity = QCryptographicHash::hash(
+                QString("%1:%2:%3").arg(fi.fileName()).arg(fi.size()).arg(fi.lastModified().toTime_t()).toUtf8(),
+                QCryptographicHash::Sha1 );
+    QByteArray hash = read( identity, "contentHash" );
+    if (!hash.isEmpty())
+        return hash;
+
+    QFile source(sourcePath);
+    if (!source.open(QIODevice::ReadOnly))
+        return QByteArray();
+    QCryptographicHash sha1( QCryptographicHash::Sha1 );
+    while (!source.atEnd())
+        sha1.addData( source.read(1024 * 1024) );
+    hash = sha1.result();
+
+    write( identity, "contentHash", hash );
+    return hash;
+}
+
+bool CacheArchive::contains( const QByteArray& hash, const QString& name )
+{
+    QMutexLocker locker(&m_lock);
+    refresh();
+    return m_index.contains( recordKey(hash, name) );
+}
+
+QByteArray CacheArchive::read( const QByteArray& hash, const QString& name )
+{
+    QMutexLocker locker(&m_lock);
+    refresh();
+    QString key = recordKey(hash, name);
+    if (!m_index.contains(key))
+        return QByteArray();
+
+    // a separate handle, so that concurrent writers keep their position
+    Entry entry = m_index[key];
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly) || !file.seek(entry.offset))
+        return QByteArray();
+    return file.read(entry.size);
+}
+
+cv::Mat CacheArchive::readMatrix( const QByteArray& hash, const QString& name, quint64 key )
+{
+    // stay locked while mapping, compaction may be swapping the file
+    QMutexLocker locker(&m_lock);
+    refresh();
+    QString rkey = recordKey(hash, name);
+    if (!m_index.contains(rkey))
+        return cv::Mat();
+    Entry entry = m_index[rkey];
+    bool verify = !m_verified.contains(rkey);
+    cv::Mat matrix = MatrixFile::map( m_path, entry.offset, entry.size, key, verify );
+    if (verify && !matrix.empty())
+        m_verified.insert(rkey);
+    return matrix;
+}
+
+bool CacheArchive::write( const QByteArray& hash, const QString& name, const QByteArray& data )
+{
+    QMutexLocker locker(&m_lock);
+    if (!m_file.isOpen() || m_readOnly)
+        return false;
+
+    QString key = recordKey(hash, name);
+    qint64 offset = beginRecord( m_file, key, data.size() );
+    if (offset < 0 || m_file.write(data) != data.size())
+        return false;
+    endRecord( key, Entry(offset, data.size()) );
+    return true;
+}
+
+bool CacheArchive::writeMatrix( const QByteArray& hash, const QString& name, const cv::Mat& matrix, quint64 key )
+{
+    QMutexLocker locker(&m_lock);
+    if (!m_file.isOpen() || m_readOnly)
+        return false;
+
+    QString rkey = recordKey(hash, name);
+    qint64 size = MatrixFile::byteSize(matrix);
+    qint64 offset = beginRecord( m_file, rkey, size );
+    if (offset < 0 || !MatrixFile::writeTo( &m_file, matrix, key ))
+        return false;
+    endRecord( rkey, Entry(offset, size) );
+    // checksummed from the pixels as they were written
+    m_verified.insert(rkey);
+    return true;
+}
+
+void CacheArchive::remove( const QByteArray& hash, const QString& name )
+{
+    QMutexLocker locker(&m_lock);
+    QString key = recordKey(hash, name);
+    if (!m_file.isOpen() || m_readOnly || !m_index.contains(key))
+        return;
+
+    // a tombstone, so that scanning the tail after a crash knows about it too
+    beginRecord( m_file, key, -1 );
+    m_garbage += m_index.take(key).size;
+    m_verified.remove(key);
+}
+
+// appends the record header and returns where the payload goes
+qint64 CacheArchive::beginRecord( QFile& file, const QString& key, qint64 payloadSize )
+{
+    QByteArray keyBytes = key.toUtf8();
+    RecordHeader h;
+    memcpy( h.magic, "VCAR", 4 );
+    h.keyLength = keyBytes.size();
+    h.payloadSize = payloadSize;
+
+    qint64 start = aligned( file.size() );
+    qint64 payload = aligned( start + sizeof(h) + keyBytes.size() );
+    if (!file.seek(start)
+            || file.write( (const char *)&h, sizeof(h) ) != sizeof(h)
+            || file.write( keyBytes ) != keyBytes.size()
+            || file.write( QByteArray( payload - file.pos(), 0 ) ) < 0) {
+        qWarning() << "Can't append to cache archive" << m_path << file.errorString();
+        return -1;
+    }
+    return payload;
+}
+
+void CacheArchive::endRecord( const QString& key, const Entry& entry )
+{
+    m_file.flush();
+    if (m_index.contains(key))
+        m_garbage += m_index[key].size;
+    m_index[key] = entry;
+    m_verified.remove(key);
+    compactLater();
+}
+
+// picks up records appended after the saved index (or by a crashed session),
+// returns where the last intact record ends
+qint64 CacheArchive::scan( qint64 from )
+{
+    qint64 pos = aligned(from), end = m_file.size();
+    while (pos + (qint64)sizeof(RecordHeader) <= end) {
+        RecordHeader h;
+        if (!m_file.seek(pos) || m_file.read( (char *)&h, sizeof(h) ) != sizeof(h)
+                || memcmp( h.magic, "VCAR", 4 ))
+            return pos;
+        QString key = QString::fromUtf8( m_file.read(h.keyLength) );
+        qint64 payload = aligned( pos + sizeof(h) + h.keyLength );
+
+        if (h.payloadSize < 0) {
+            if (m_index.contains(key))
+                m_garbage += m_index.take(key).size;
+            pos = payload;
+            continue;
+        }
+        if (payload + h.payloadSize > end) // torn write
+            return pos;
+        if (m_index.contains(key))
+            m_garbage += m_index[key].size;
+        m_index[key] = Entry( payload, h.payloadSize );
+        pos = aligned( payload + h.payloadSize );
+    }
+    return qMin( pos, end );
+}
+
+// cache.vca keeps its index in cache.vci
+QString CacheArchive::indexPath() const
+{
+    QFileInfo fi(m_path);
+    return fi.dir().filePath( fi.completeBaseName() + ".vci" );
+}
+
+void CacheArchive::loadIndex()
+{
+    m_index.clear();
+    m_garbage = 0;
+    qint64 covered = 0;
+
+    QFile file( indexPath() );
+    if (file.open(QIODevice::ReadOnly)) {
+        QDataStream in(&file);
+        quint32 magic, version;
+        quint64 id;
+        in >> magic >> version;
+        if (magic == s_indexMagic && version == s_indexVersion) {
+            // an index of the file before a compaction is no good
+            in >> id >> covered >> m_garbage >> m_index;
+            if (in.status() != QDataStream::Ok || id != m_fileId || covered > m_file.size()) {
+                m_index.clear();
+                covered = m_garbage = 0;
+            }
+        }
+    }
+
+    m_scanned = scan(covered);
+    // the writing process may be in the middle of appending
+    if (m_scanned < m_file.size() && !m_readOnly) {
+        qWarning() << "Cache archive" << m_path << "has a damaged tail, truncating";
+        m_file.resize(m_scanned);
+    }
+}
+
+void CacheArchive::saveIndex()
+{
+    QFile file( indexPath() );
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+    QDataStream out(&file);
+    out << s_indexMagic << s_indexVersion << m_fileId << m_file.size() << m_garbage << m_index;
+}
+
+void CacheArchive::compactLater()
+{
+    if (m_garbage < COMPACTION_THRESHOLD / 2 || m_garbage * 2 < m_file.size() || m_compaction.isRunning())
+        return;
+    if (m_compactionFailedAt >= 0 && m_file.size() < m_compactionFailedAt + COMPACTION_THRESHOLD)
+        return;
+    m_compaction = QtConcurrent::run( this, &CacheArchive::compact );
+}
+
+// Copies live records into a new file while writers keep appending to the
+// old one, then catches up with what they appended and swaps the files.
+void CacheArchive::compact()
+{
+    QMutexLocker locker(&m_lock);
+    QHash< QString, Entry > live = m_index;
+    qint64 copiedUpTo = m_file.size();
+    locker.unlock();
+
+    QFile source(m_path), target(m_path + ".compact");
+    if (!source.open(QIODevice::ReadOnly) || !target.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        locker.relock();
+        compactionFailed( target );
+        return;
+    }
+
+    QHash< QString, Entry > index;
+    QHashIterator< QString, Entry > i(live);
+    while (i.hasNext()) {
+        i.next();
+        source.seek( i.value().offset );
+        qint64 offset = beginRecord( target, i.key(), i.value().size );
+        if (offset < 0 || target.write( source.read( i.value().size ) ) != i.value().size) {
+            locker.relock();
+            compactionFailed( target );
+            return;
+        }
+        index[i.key()] = Entry( offset, i.value().size );
+    }
+
+    locker.relock();
+    // whatever was appended or removed meanwhile
+    QHashIterator< QString, Entry > j(m_index);
+    while (j.hasNext()) {
+        j.next();
+        if (j.value().offset < copiedUpTo)
+            continue;
+        source.seek( j.value().offset );
+        qint64 offset = beginRecord( target, j.key(), j.value().size );
+        if (offset < 0 || target.write( source.read( j.value().size ) ) != j.value().size) {
+            compactionFailed( target );
+            return;
+        }
+        index[j.key()] = Entry( offset, j.value().size );
+    }
+    foreach(QString key, index.keys())
+        if (!m_index.contains(key))
+            index.remove(key);
+    target.flush();
+#ifdef Q_OS_UNIX
+    // on disk before it replaces the archive
+    fsync( target.handle() );
+#endif
+    target.close();
+
+    qint64 before = m_file.size();
+    m_file.close();
+    // mapped matrices keep the old file alive until they go
+#ifdef Q_OS_UNIX
+    // rename(2) swaps the files in one step, a crash leaves the one or the other
+    bool swapped = ::rename( QFile::encodeName( target.fileName() ).constData(),
+                             QFile::encodeName( m_path ).constData() ) == 0;
+#else
+    bool swapped = QFile::remove(m_path) && target.rename(m_path);
+#endif
+    if (!m_file.open(QIODevice::ReadWrite)) {
+        qWarning() << "Can't reopen cache archive" << m_path << m_file.errorString();
+        m_index.clear();
+        return;
+    }
+    if (!swapped) {
+        compactionFailed( target );
+        return;
+    }
+    m_fileId = fileId(m_file);
+    m_index = index;
+    m_garbage = 0;
+    m_compactionFailedAt = -1;
+    saveIndex();
+
+    qDebug() << "Compacted cache archive" << m_path << "from" << before / 1048576 << "to"
+             << m_file.size() / 1048576 << "MB";
+}
+
+// the partial copy goes, and writes don't start another one right away;
+// called locked
+void CacheArchive::compactionFailed( QFile& target )
+{
+    qWarning() << "Can't compact cache archive" << m_path << target.errorString();
+    target.close();
+    QFile::remove( target.fileName() );
+    m_compactionFailedAt = m_file.size();
+}
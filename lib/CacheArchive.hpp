@@ -0,0 +1,102 @@
+#pragma once
+
+namespace QArtm {
+
+class MatrixJournal;
+
+// All cached artifacts of an event directory in one append-only file.
+// Records are addressed by the content hash of the source file plus an
+// artifact name, so renamed or duplicated photos share their cache. An
+// index makes lookups O(1); superseded records are dropped by a compaction
+// running in the background once they take up too much of the file.
+//
+// One process writes an archive at a time: open() takes an exclusive lock
+// on path + ".lock" and, if another process holds it, opens the archive
+// read only, so the gui and BatchCounter can share a directory. A read only
+// archive follows the writer: lookups pick up appended records first, and
+// reload the index once a compaction replaced the file.
+class CacheArchive {
+public:
+    CacheArchive();
+    ~CacheArchive();
+
+    bool open( const QString& path );
+    void close();
+    QString path() const { return m_path; }
+    // another process has it open for writing, writes fail
+    bool isReadOnly() const { return m_readOnly; }
+
+    // SHA-1 of the file contents, memoized in the archive per name, size and mtime
+    QByteArray contentHash( const QString& sourcePath );
+
+    bool contains( const QByteArray& hash, const QString& name );
+    QByteArray read( const QByteArray& hash, const QString& name );
+    bool write( const QByteArray& hash, const QString& name, const QByteArray& data );
+    void remove( const QByteArray& hash, const QString& name );
+
+    // matrices are mapped straight from the archive, see MatrixFile
+    cv::Mat readMatrix( const QByteArray& hash, const QString& name, quint64 key );
+    bool writeMatrix( const QByteArray& hash, const QString& name, const cv::Mat& matrix, quint64 key );
+
+    // edits to archived matrices, written in the background, see MatrixJournal
+    MatrixJournal * journal() const { return m_journal.data(); }
+
+    qint64 size() const;
+    qint64 garbage() const;
+
+    struct Entry {
+        qint64 offset, size;
+        Entry() : offset(0), size(0) {}
+        Entry( qint64 o, qint64 s ) : offset(o), size(s) {}
+    };
+
+protected:
+    struct RecordHeader {
+        char magic[4];
+        quint32 keyLength;
+        qint64 payloadSize; // -1 marks a removed key
+    };
+
+    static const int ALIGNMENT = 64;
+    static const quint32 s_indexMagic = 0x56434149; // "VCAI"
+    static const quint32 s_indexVersion = 2;
+
+    mutable QMutex m_lock;
+    QString m_path;
+    QFile m_file;
+    QFile m_lockFile;
+    bool m_readOnly;
+    QHash< QString, Entry > m_index;
+    // matrix records whose checksum was checked since the archive was opened
+    QSet< QString > m_verified;
+    qint64 m_garbage;
+    // the inode of the open archive, a compaction replaces it
+    quint64 m_fileId;
+    // where the last intact record ends
+    qint64 m_scanned;
+    QFuture<void> m_compaction;
+    // archive size when a compaction failed, the next waits for it to grow
+    qint64 m_compactionFailedAt;
+    QScopedPointer< MatrixJournal > m_journal;
+
+    static QString recordKey( const QByteArray& hash, const QString& name );
+    static qint64 aligned( qint64 offset );
+    static quint64 fileId( const QFile& file );
+    bool lock();
+    void refresh();
+
+    qint64 beginRecord( QFile& file, const QString& key, qint64 payloadSize );
+    void endRecord( const QString& key, const Entry& entry );
+    qint64 scan( qint64 from );
+    QString indexPath() const;
+    void loadIndex();
+    void saveIndex();
+    void compactLater();
+    void compact();
+    void compactionFailed( QFile& target );
+};
+
+}
+
+QDataStream& operator<<( QDataStream& out, const QArtm::CacheArchive::Entry& entry );
+QDataStream& operator>>( QDataStream& in, QArtm::CacheArchive::Entry& entry );
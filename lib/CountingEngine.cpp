@@ -0,0 +1,464 @@
+#include "CountingEngine.hpp"
+#include "CacheArchive.hpp"
+#include "BufferPool.hpp"
+#include "ImageLoader.hpp"
+
+using namespace QArtm;
+
+QVector<int> CountingEngine::Result::counts() const
+{
+    QVector<int> result;
+    foreach(const Contours& contours, cards)
+        result << (int)contours.size();
+    return result;
+}
+
+CountingEngine::CountingEngine()
+    : m_version(0)
+{
+}
+
+CountingEngine::~CountingEngine()
+{
+}
+
+bool CountingEngine::load( const QDir& dir )
+{
+    QString palette_file = dir.filePath("palette.png");
+    QString flann_file = dir.filePath("flann.dat");
+    if ( !QFileInfo(palette_file).exists() || !QFileInfo(flann_file).exists())
+        return false;
+
+    cv::Mat rgb = cv::imread( palette_file.toStdString(), -1 );
+    if (rgb.empty())
+        return false;
+    cv::Mat lab = toLab(rgb);
+    m_paletteRGB = cv::Mat(rgb.rows, 3, CV_8UC1, rgb.data).clone();
+    m_paletteLab = cv::Mat(lab.rows, 3, CV_32FC1, lab.data).clone();
+    m_version = paletteVersion( m_paletteLab );
+
+    cvflann::SavedIndexParams params(flann_file.toStdString());
+    m_index.reset( new ColorIndex(m_paletteLab, params) );
+    return true;
+}
+
+bool CountingEngine::save( const QDir& dir ) const
+{
+    if (!isTrained())
+        return false;
+
+    QString palette_file = dir.filePath("palette.png");
+    if (!cv::imwrite( palette_file.toStdString(), cv::Mat(m_paletteRGB.rows, 1, CV_8UC3, m_paletteRGB.data) ))
+        return false;
+
+    QString flann_file = dir.filePath("flann.dat");
+    m_index->save( flann_file.toStdString() );
+    return true;
+}
+
+void CountingEngine::setPalette( const cv::Mat& paletteLab )
+{
+    m_paletteLab = paletteLab.clone();
+    m_version = paletteVersion( m_paletteLab );
+
+    m_paletteRGB = cv::Mat( m_paletteLab.rows, 3, CV_32FC1 );
+    cv::cvtColor( cv::Mat(m_paletteLab.rows, 1, CV_32FC3, m_paletteLab.data),
+                  cv::Mat(m_paletteLab.rows, 1, CV_32FC3, m_paletteRGB.data),
+                  CV_Lab2RGB );
+    m_paletteRGB.convertTo( m_paletteRGB, CV_8UC1, 255.0 );
+
+    cvflann::AutotunedIndexParams params( 0.8, 1, 0, 1.0 );
+    //cvflann::LinearIndexParams params;
+    m_index.reset( new ColorIndex(m_paletteLab, params) );
+}
+
+void CountingEngine::classifyTile( const cv::Mat& lab, const cv::Rect& tile, cv::Mat& indices, cv::Mat& dists,
+                                   bool approximate ) const
+{
+    cvflann::SearchParams params(approximate ? APPROXIMATE_CHECKS : cvflann::FLANN_CHECKS_UNLIMITED, 0);
+
+    // knnSearch wants a continuous list of pixels, tile ROI isn't one;
+    // tiles are mostly the same size, so their buffers come from the pool
+    BufferPool * pool = BufferPool::instance();
+    cv::Mat input = pool->matrix( tile.height, tile.width, lab.type() );
+    cv::Mat(lab, tile).copyTo( input );
+    int n_pixels = tile.width * tile.height;
+    cv::Mat input_1 = input.reshape( 1, n_pixels );
+    cv::Mat indices_1 = pool->matrix( n_pixels, 1, CV_32SC1 );
+    cv::Mat dists_1 = pool->matrix( n_pixels, 1, CV_32FC1 );
+
+    m_index->knnSearch( input_1, indices_1, dists_1, 1, params);
+
+    cv::Mat indicesROI( indices, tile ), distsROI( dists, tile );
+    indices_1.reshape( 1, tile.height ).copyTo( indicesROI );
+    dists_1.reshape( 1, tile.height ).copyTo( distsROI );
+}
+
+void CountingEngine::classify( const cv::Mat& lab, cv::Mat& indices, cv::Mat& dists, bool approximate ) const
+{
+    BufferPool * pool = BufferPool::instance();
+    indices = pool->matrix( lab.rows, lab.cols, CV_32SC1 );
+    dists = pool->matrix( lab.rows, lab.cols, CV_32FC1 );
+    foreach(const cv::Rect& tile, tiles( lab.size() ))
+        classifyTile( lab, tile, indices, dists, approximate );
+}
+
+int CountingEngine::classify( const cv::Mat& lab, cv::Mat& fingerprints, const Reference& reference,
+                              cv::Mat& indices, cv::Mat& dists, bool approximate ) const
+{
+    BufferPool * pool = BufferPool::instance();
+    indices = pool->matrix( lab.rows, lab.cols, CV_32SC1 );
+    dists = pool->matrix( lab.rows, lab.cols, CV_32FC1 );
+    int reused = 0;
+    foreach(const cv::Rect& tile, tiles( lab.size() )) {
+        if (reuseTile( reference, fingerprints, tile, indices, dists ))
+            reused++;
+        else
+            classifyTile( lab, tile, indices, dists, approximate );
+    }
+    return reused;
+}
+
+CountingEngine::Result CountingEngine::count( const cv::Mat& indices, const cv::Mat& dists, int threshold, int sizeFilter )
+{
+    Result result;
+    result.threshold = threshold;
+    result.sizeFilter = sizeFilter;
+    result.indices = indices;
+    result.dists = dists;
+    result.masks = cardMasks( indices, dists, threshold );
+    foreach(const cv::Mat& mask, result.masks)
+        result.cards << cardContours( mask, sizeFilter );
+    return result;
+}
+
+CountingEngine::Result CountingEngine::count( QSharedPointer< CacheArchive > archive, const QString& path,
+                                              const Parameters& params, bool cachedOnly ) const
+{
+    QMap< QString, int > timings;
+    QTime time;
+    time.start();
+
+    QByteArray hash;
+    if (archive)
+        hash = archive->contentHash( path );
+    quint64 key = classificationKey( params.sizeLimit );
+
+    cv::Mat indices, dists;
+    int tileCount = 0, reusedTiles = 0;
+    bool archived = archive && loadClassification( archive, hash, key, indices, dists );
+    if (!archived) {
+        if (cachedOnly)
+            return Result();
+        cv::Mat input = archive ? loadInput( archive, hash, path, params.sizeLimit )
+                                : decode( path, params.sizeLimit );
+        if (input.empty())
+            return Result();
+        timings["decode"] = time.restart();
+        cv::Mat prints = fingerprints( input );
+        cv::Mat lab = archive ? loadLab( archive, hash, input, params.sizeLimit ) : toLab( input );
+        input = cv::Mat();
+        timings["lab"] = time.restart();
+        Reference reference;
+        if (archive)
+            loadReference( archive, hash, key, prints, lab.size(), reference );
+        tileCount = prints.rows;
+        reusedTiles = classify( lab, prints, reference, indices, dists, params.approximate );
+        if (archive && !params.approximate) {
+            archived = saveClassification( archive, hash, indices, dists, key );
+            saveFingerprints( archive, hash, prints, key );
+        }
+        timings["classify"] = time.restart();
+    } else {
+        timings["decode"] = time.restart();
+    }
+
+    Result result = count( indices, dists, params.threshold, params.sizeFilter );
+    result.classificationKey = key;
+    result.tiles = tileCount;
+    result.reusedTiles = reusedTiles;
+    result.archived = archived;
+    timings["count"] = time.elapsed();
+    result.timings = timings;
+    return result;
+}
+
+cv::Mat CountingEngine::loadInput( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                                   const QString& path, int sizeLimit )
+{
+    // matrices made for another working size are keyed differently
+    cv::Mat input = archive->readMatrix( contentHash, "input", sizeLimit );
+    if (!input.empty()) {
+        qDebug() << "Mapped cached input of" << qPrintable(path);
+        return input;
+    }
+
+    input = decode( path, sizeLimit );
+    if (!input.empty())
+        archive->writeMatrix( contentHash, "input", input, sizeLimit );
+    return input;
+}
+
+cv::Mat CountingEngine::decode( const QString& path, int sizeLimit )
+{
+    QImage img = ImageLoader::scaled( path, sizeLimit )
+            .convertToFormat(QImage::Format_RGB888);
+    if (img.isNull())
+        return cv::Mat();
+
+    return cv::Mat( img.height(), img.width(), CV_8UC3, (void*)img.constBits(), img.bytesPerLine() ).clone();
+}
+
+cv::Mat CountingEngine::loadLab( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                                 const cv::Mat& input, int sizeLimit )
+{
+    cv::Mat lab = archive->readMatrix( contentHash, "lab", sizeLimit );
+    if (lab.empty()) {
+        lab = toLab( input );
+        archive->writeMatrix( contentHash, "lab", lab, sizeLimit );
+    }
+    return lab;
+}
+
+cv::Mat CountingEngine::toLab( const cv::Mat& input )
+{
+    cv::Mat lab = BufferPool::instance()->matrix( input.rows, input.cols, CV_32FC3 );
+    input.convertTo(lab, CV_32FC3, 1.0/255.0);
+    cv::cvtColor( lab, lab, CV_RGB2Lab );
+    return lab;
+}
+
+cv::Mat CountingEngine::learnPalette( const cv::Mat& lab, const QList< cv::Mat >& trainingMasks )
+{
+    QVector<cv::Mat> centers_list;
+    int centers_count = 0;
+
+    foreach(const cv::Mat& mask, trainingMasks) {
+        QVector<ColorType> sample_pixels;
+
+        for(int i = 0; i<lab.rows; ++i)
+            for(int j = 0; j<lab.cols; ++j)
+                if (mask.at<unsigned char>(i,j))
+                    // copy this pixel
+                    sample_pixels
+                            << lab.ptr<ColorType>(i)[j*3]
+                            << lab.ptr<ColorType>(i)[j*3+1]
+                            << lab.ptr<ColorType>(i)[j*3+2];
+
+        if (sample_pixels.size()==0) continue;
+
+        cv::Mat sample(sample_pixels.size()/3, 3, CV_32FC1, sample_pixels.data());
+        // cv::flann::hierarchicalClustering returns float centers even for integer palette
+        cv::Mat centers(COLOR_GRADATIONS, 3, CV_32FC1);
+        cvflann::KMeansIndexParams params(
+                    COLOR_GRADATIONS, // branching
+                    10, // max iterations
+                    cvflann::FLANN_CENTERS_KMEANSPP,
+                    0);
+        int n_clusters = cv::flann::hierarchicalClustering< ColorDistance >( sample, centers, params );
+        centers_list << centers;
+        centers_count += n_clusters;
+    }
+
+    cv::Mat paletteLab = cv::Mat( centers_count, 3, CV_32FC1 );
+    for(int i=0; i<centers_list.size(); ++i)
+        centers_list[i].copyTo( paletteLab.rowRange( i*COLOR_GRADATIONS,(i+1)*COLOR_GRADATIONS ) );
+    return paletteLab;
+}
+
+quint64 CountingEngine::paletteVersion( const cv::Mat& paletteLab )
+{
+    QCryptographicHash hash( QCryptographicHash::Md5 );
+    hash.addData( (const char *)paletteLab.data, paletteLab.total() * paletteLab.elemSize() );
+    return qFromLittleEndian<quint64>( (const uchar *)hash.result().constData() );
+}
+
+// classification depends on the input and on the palette
+quint64 CountingEngine::classificationKey( int sizeLimit, quint64 paletteVersion )
+{
+    QCryptographicHash hash( QCryptographicHash::Md5 );
+    hash.addData( QByteArray::number( sizeLimit ) );
+    hash.addData( QByteArray::number( paletteVersion ) );
+    return qFromLittleEndian<quint64>( (const uchar *)hash.result().constData() );
+}
+
+// cards depend on the classification and on the sliders
+quint64 CountingEngine::countKey( quint64 classificationKey, int threshold, int sizeFilter )
+{
+    QCryptographicHash hash( QCryptographicHash::Md5 );
+    hash.addData( QByteArray::number( classificationKey ) );
+    hash.addData( QByteArray::number( threshold ) );
+    hash.addData( QByteArray::number( sizeFilter ) );
+    return qFromLittleEndian<quint64>( (const uchar *)hash.result().constData() );
+}
+
+// Classification is kept as 8 bit palette indices and distances quantized to
+// 16 bit: square root of the squared Lab distance in 1/256 steps, which is
+// far finer than the threshold slider and saturates way above its range
+bool CountingEngine::saveClassification( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                                         const cv::Mat& indices, const cv::Mat& dists, quint64 key )
+{
+    cv::Mat classes, distances;
+    quantize( indices, dists, classes, distances );
+    return saveQuantized( archive, contentHash, classes, distances, key );
+}
+
+void CountingEngine::quantize( const cv::Mat& indices, const cv::Mat& dists, cv::Mat& classes, cv::Mat& distances )
+{
+    indices.convertTo( classes, CV_8UC1 );
+    cv::sqrt( dists, distances );
+    distances.convertTo( distances, CV_16UC1, 256.0 );
+}
+
+bool CountingEngine::saveQuantized( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                                    const cv::Mat& classes, const cv::Mat& distances, quint64 key )
+{
+    return archive->writeMatrix( contentHash, "classes", classes, key )
+            && archive->writeMatrix( contentHash, "distances", distances, key );
+}
+
+bool CountingEngine::loadClassification( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                                         quint64 key, cv::Mat& indices, cv::Mat& dists )
+{
+    cv::Mat classes = archive->readMatrix( contentHash, "classes", key );
+    cv::Mat distances = archive->readMatrix( contentHash, "distances", key );
+    if (classes.empty() || distances.empty())
+        return false;
+
+    classes.convertTo( indices, CV_32SC1 );
+    distances.convertTo( dists, CV_32FC1, 1.0 / 256.0 );
+    cv::multiply( dists, dists, dists );
+    return true;
+}
+
+QList< cv::Rect > CountingEngine::tiles( const cv::Size& size )
+{
+    QList< cv::Rect > result;
+    for(int y = 0; y < size.height; y += TILE_SIZE)
+        for(int x = 0; x < size.width; x += TILE_SIZE)
+            result << cv::Rect( x, y, std::min(TILE_SIZE, size.width - x), std::min(TILE_SIZE, size.height - y) );
+    return result;
+}
+
+cv::Mat CountingEngine::fingerprints( const cv::Mat& input )
+{
+    QList< cv::Rect > tileList = tiles( input.size() );
+    cv::Mat result( tileList.size(), FINGERPRINT_BLOCKS * FINGERPRINT_BLOCKS * 3, CV_8UC1 );
+    for(int i = 0; i < tileList.size(); i++) {
+        cv::Mat blocks( FINGERPRINT_BLOCKS, FINGERPRINT_BLOCKS, CV_8UC3, result.ptr(i) );
+        cv::resize( cv::Mat(input, tileList[i]), blocks, blocks.size(), 0, 0, cv::INTER_AREA );
+    }
+    return result;
+}
+
+// the reference is whatever photo was classified last with the key, which
+// is the previous one of a tripod series being ingested as it comes
+static QString referenceName( quint64 key )
+{
+    return QString("reference.%1").arg( key );
+}
+
+bool CountingEngine::saveFingerprints( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                                       const cv::Mat& fingerprints, quint64 key )
+{
+    return archive->writeMatrix( contentHash, "fingerprints", fingerprints, key )
+            && archive->write( QByteArray(), referenceName( key ), contentHash );
+}
+
+bool CountingEngine::loadReference( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                                    quint64 key, const cv::Mat& fingerprints, const cv::Size& size,
+                                    Reference& reference )
+{
+    reference = Reference();
+    QByteArray hash = archive->read( QByteArray(), referenceName( key ) );
+    if (hash.isEmpty() || hash == contentHash)
+        return false;
+
+    cv::Mat prints = archive->readMatrix( hash, "fingerprints", key );
+    if (prints.rows != fingerprints.rows || prints.cols != fingerprints.cols)
+        return false;
+
+    // another camera position, nothing to gain from mapping its classification
+    bool any = false;
+    for(int i = 0; i < prints.rows && !any; i++)
+        any = cv::norm( prints.row(i), fingerprints.row(i), cv::NORM_INF ) <= FINGERPRINT_TOLERANCE;
+    if (!any)
+        return false;
+
+    cv::Mat indices, dists;
+    if (!loadClassification( archive, hash, key, indices, dists ) || indices.size() != size)
+        return false;
+
+    reference.contentHash = hash;
+    reference.fingerprints = prints;
+    reference.indices = indices;
+    reference.dists = dists;
+    return true;
+}
+
+bool CountingEngine::reuseTile( const Reference& reference, cv::Mat& fingerprints, const cv::Rect& tile,
+                                cv::Mat& indices, cv::Mat& dists )
+{
+    if (!reference.isValid())
+        return false;
+
+    // tiles() goes row by row
+    int tilesPerRow = (indices.cols + TILE_SIZE - 1) / TILE_SIZE;
+    int i = (tile.y / TILE_SIZE) * tilesPerRow + tile.x / TILE_SIZE;
+    if (i >= fingerprints.rows
+            || cv::norm( reference.fingerprints.row(i), fingerprints.row(i), cv::NORM_INF ) > FINGERPRINT_TOLERANCE)
+        return false;
+
+    cv::Mat indicesROI( indices, tile ), distsROI( dists, tile );
+    cv::Mat( reference.indices, tile ).copyTo( indicesROI );
+    cv::Mat( reference.dists, tile ).copyTo( distsROI );
+    reference.fingerprints.row(i).copyTo( fingerprints.row(i) );
+    return true;
+}
+
+// pixels close enough to the palette, per card color, opened to drop specks;
+// threshold is the slider value, the squared Lab distance limit is 3*t^2
+QVector< cv::Mat > CountingEngine::cardMasks( const cv::Mat& indices, const cv::Mat& dists, int threshold )
+{
+    float thresh = 3.0 * threshold * threshold;
+
+    // same sizes every time the slider moves, recycle the buffers
+    BufferPool * pool = BufferPool::instance();
+    cv::Mat thresholdedDiff = pool->matrix( dists.rows, dists.cols, CV_32FC1 );
+    cv::threshold(dists, thresholdedDiff, thresh, 0, cv::THRESH_TRUNC);
+    thresholdedDiff.convertTo( thresholdedDiff, CV_8UC1, - 255.0 / thresh, 255.0 );
+
+    int n_pixels = indices.rows * indices.cols;
+    QVector<cv::Mat> masks;
+    for(int i=0; i<CARD_COLORS; i++)
+        masks << pool->matrix( indices.rows, indices.cols, CV_8UC1, cv::Scalar(0) );
+
+    for(int i=0; i<n_pixels; i++) {
+        if (thresholdedDiff.data[i]) {
+            int index = indices.ptr<int>(0)[i];
+            int color = index / COLOR_GRADATIONS;
+            masks[color].data[i] = 1;
+        }
+    }
+
+    for(int i=0; i<masks.size(); i++)
+        cv::morphologyEx( masks[i], masks[i], cv::MORPH_OPEN, cv::Mat() );
+    return masks;
+}
+
+// outlines of the cards in a mask, sizeFilter is the slider value, the
+// smallest card's side in pixels
+CountingEngine::Contours CountingEngine::cardContours( const cv::Mat& mask, int sizeFilter )
+{
+    // copy mask because find contours corrupts
+    cv::Mat scratch = BufferPool::instance()->matrix( mask.rows, mask.cols, mask.type() );
+    mask.copyTo( scratch );
+    Contours contours, cards;
+    cv::findContours(scratch, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_TC89_L1);
+
+    double minSize = sizeFilter * sizeFilter;
+    for(size_t i = 0; i < contours.size(); i++)
+        if (cv::contourArea(contours[i]) >= minSize)
+            cards.push_back(contours[i]);
+    return cards;
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <opencv2/flann/flann.hpp>
+
+namespace QArtm {
+
+class CacheArchive;
+
+// The vision side of counting cards, without any widgets: decoding at the
+// working size, Lab conversion, classification against the learned
+// palette, thresholding, morphology and blob extraction. Parameters are
+// passed in and results are plain matrices and contours.
+//
+// An engine only holds its palette and classifier, built once and not
+// changed afterwards, so one engine can count on any number of threads at
+// the same time and engines for different directories work side by side.
+// Relearning makes a new engine; jobs in flight keep the one they started
+// with.
+class CountingEngine {
+public:
+    typedef float ColorType;
+    typedef cv::flann::L2<ColorType> ColorDistance;
+    typedef cv::flann::GenericIndex< ColorDistance > ColorIndex;
+    typedef std::vector< cv::Point > Contour;
+    typedef std::vector< Contour > Contours;
+
+    // green, pink and yellow cards, each learned as a few gradations
+    static const int CARD_COLORS = 3;
+    static const int COLOR_GRADATIONS = 5;
+    static const int TILE_SIZE = 256;
+    // FLANN checks per pixel of an approximate classification
+    static const int APPROXIMATE_CHECKS = 32;
+    // a tile's fingerprint is its colors averaged down to this many blocks
+    // a side; tiles whose blocks are all within the tolerance are the same
+    static const int FINGERPRINT_BLOCKS = 16;
+    static const int FINGERPRINT_TOLERANCE = 6;
+
+    struct Parameters {
+        int sizeLimit;  // longest side of the working image
+        int threshold;  // colorDiffThreshold, the squared Lab distance limit is 3*t^2
+        int sizeFilter; // side of the smallest card in pixels
+        // bounded search instead of an exhaustive one, never cached
+        bool approximate;
+        Parameters() : sizeLimit(1024), threshold(10), sizeFilter(10), approximate(false) {}
+    };
+
+    struct Result {
+        quint64 classificationKey;
+        int threshold, sizeFilter;
+        cv::Mat indices, dists;
+        // per card color
+        QVector< cv::Mat > masks;
+        QVector< Contours > cards;
+        // ms per stage the whole pipeline went through, "classify" is missing
+        // when the classification came from the cache
+        QMap< QString, int > timings;
+        // tiles classified, and how many of them were copied from the reference
+        int tiles, reusedTiles;
+        // the classification can be loaded from the archive again
+        bool archived;
+        Result() : classificationKey(0), threshold(0), sizeFilter(0), tiles(0), reusedTiles(0), archived(false) {}
+
+        QVector<int> counts() const;
+    };
+
+    // the photo classified last with the same key. Tripod shots differ only
+    // where people moved, the rest of its classification is reused
+    struct Reference {
+        QByteArray contentHash;
+        cv::Mat fingerprints, indices, dists;
+        bool isValid() const { return !indices.empty(); }
+    };
+
+    CountingEngine();
+    ~CountingEngine();
+
+    // palette.png and flann.dat of a trained directory
+    bool load( const QDir& dir );
+    bool save( const QDir& dir ) const;
+    // builds the classifier for a freshly learned palette, see learnPalette
+    void setPalette( const cv::Mat& paletteLab );
+
+    bool isTrained() const { return !m_index.isNull(); }
+    cv::Mat paletteLab() const { return m_paletteLab; }
+    // one 8 bit RGB row per palette entry
+    cv::Mat paletteRGB() const { return m_paletteRGB; }
+    // changes whenever the palette does, part of every classification key
+    quint64 version() const { return m_version; }
+    quint64 classificationKey( int sizeLimit ) const { return classificationKey( sizeLimit, m_version ); }
+
+    void classifyTile( const cv::Mat& lab, const cv::Rect& tile, cv::Mat& indices, cv::Mat& dists,
+                       bool approximate = false ) const;
+    void classify( const cv::Mat& lab, cv::Mat& indices, cv::Mat& dists, bool approximate = false ) const;
+    // returns how many tiles came from the reference, see reuseTile
+    int classify( const cv::Mat& lab, cv::Mat& fingerprints, const Reference& reference,
+                  cv::Mat& indices, cv::Mat& dists, bool approximate = false ) const;
+
+    // the cards of a classification
+    static Result count( const cv::Mat& indices, const cv::Mat& dists, int threshold, int sizeFilter );
+    // the whole pipeline for a photo; whatever the archive has is reused,
+    // whatever gets computed is added to it. Without an archive nothing is
+    // cached, with cachedOnly nothing but the cards is computed and the
+    // result is empty if the classification isn't in the archive. An
+    // approximate classification isn't stored, a cached exact one is used.
+    Result count( QSharedPointer< CacheArchive > archive, const QString& path, const Parameters& params,
+                  bool cachedOnly = false ) const;
+
+    static cv::Mat decode( const QString& path, int sizeLimit );
+    static cv::Mat loadInput( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                              const QString& path, int sizeLimit );
+    static cv::Mat loadLab( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                            const cv::Mat& input, int sizeLimit );
+    static cv::Mat toLab( const cv::Mat& input );
+    // clusters the Lab pixels under each card color's training mask
+    static cv::Mat learnPalette( const cv::Mat& lab, const QList< cv::Mat >& trainingMasks );
+    static quint64 paletteVersion( const cv::Mat& paletteLab );
+    static quint64 classificationKey( int sizeLimit, quint64 paletteVersion );
+    static quint64 countKey( quint64 classificationKey, int threshold, int sizeFilter );
+    static bool saveClassification( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                                    const cv::Mat& indices, const cv::Mat& dists, quint64 key );
+    // the classification as it's cached, 8 bit classes and 16 bit distances
+    static void quantize( const cv::Mat& indices, const cv::Mat& dists, cv::Mat& classes, cv::Mat& distances );
+    static bool saveQuantized( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                               const cv::Mat& classes, const cv::Mat& distances, quint64 key );
+    static bool loadClassification( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                                    quint64 key, cv::Mat& indices, cv::Mat& dists );
+    static QList< cv::Rect > tiles( const cv::Size& size );
+
+    // one row per tile of the working image, in the order of tiles()
+    static cv::Mat fingerprints( const cv::Mat& input );
+    // stored with the classification, and the photo becomes the reference
+    static bool saveFingerprints( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                                  const cv::Mat& fingerprints, quint64 key );
+    // false if there's no reference of the same size or none of its tiles match
+    static bool loadReference( QSharedPointer< CacheArchive > archive, const QByteArray& contentHash,
+                               quint64 key, const cv::Mat& fingerprints, const cv::Size& size,
+                               Reference& reference );
+    // copies the tile's classification from the reference if it looks the
+    // same, and the reference's fingerprint along with it: what gets saved
+    // is what the classification was computed from, so a tile drifting a
+    // little from photo to photo is classified again once it drifted enough
+    static bool reuseTile( const Reference& reference, cv::Mat& fingerprints, const cv::Rect& tile,
+                           cv::Mat& indices, cv::Mat& dists );
+    static QVector< cv::Mat > cardMasks( const cv::Mat& indices, const cv::Mat& dists, int threshold );
+    static Contours cardContours( const cv::Mat& mask, int sizeFilter );
+
+protected:
+    // the index refers to m_paletteLab's data
+    cv::Mat m_paletteLab, m_paletteRGB;
+    QScopedPointer< ColorIndex > m_index;
+    quint64 m_version;
+
+private:
+    Q_DISABLE_COPY(CountingEngine)
+};
+
+}
@@ -0,0 +1,80 @@
+#include "DeadlinePlanner.hpp"
+
+using namespace QArtm;
+
+// how much a new measurement moves the learned cost
+static const double s_learningRate = 0.3;
+
+DeadlinePlanner::DeadlinePlanner()
+    : m_aspect(0.75)
+{
+    m_costs["decode"] = 150;
+    m_costs["lab"] = 40;
+    m_costs["classify"] = 900;
+    m_costs["classify.approximate"] = 300;
+    m_costs["count"] = 60;
+}
+
+QString DeadlinePlanner::classifyStage( bool approximate )
+{
+    return approximate ? "classify.approximate" : "classify";
+}
+
+int DeadlinePlanner::predict( const CountingEngine::Parameters& params ) const
+{
+    QMutexLocker locker(&m_lock);
+    double megapixels = params.sizeLimit * (params.sizeLimit * m_aspect) / 1e6;
+    double ms = m_costs["decode"] + m_costs["lab"] + m_costs[ classifyStage(params.approximate) ] + m_costs["count"];
+    return qRound( ms * megapixels );
+}
+
+DeadlinePlanner::Plan DeadlinePlanner::plan( int budget, const CountingEngine::Parameters& full ) const
+{
+    Plan plan;
+    // smaller working sizes in steps of a quarter, exact before approximate
+    for(int size = full.sizeLimit; ; size = qMax( MIN_SIZE_LIMIT, size * 3 / 4 / 16 * 16 )) {
+        for(int approximate = 0; approximate < 2; approximate++) {
+            plan.parameters = full;
+            plan.parameters.sizeLimit = size;
+            plan.parameters.approximate = approximate;
+            // the smallest card shrinks with the photo
+            plan.parameters.sizeFilter = qMax( 1, full.sizeFilter * size / full.sizeLimit );
+            plan.predicted = predict( plan.parameters );
+            plan.refine = size != full.sizeLimit || approximate;
+            if (plan.predicted <= budget)
+                return plan;
+        }
+        if (size <= MIN_SIZE_LIMIT)
+            return plan;
+    }
+}
+
+void DeadlinePlanner::record( const CountingEngine::Parameters& params, const CountingEngine::Result& result )
+{
+    // a cached classification says nothing about what computing one costs
+    double pixels = result.indices.rows * result.indices.cols;
+    if (pixels <= 0 || !result.timings.contains("classify"))
+        return;
+    double megapixels = pixels / 1e6;
+
+    QMutexLocker locker(&m_lock);
+    int longest = qMax( result.indices.rows, result.indices.cols );
+    m_aspect += s_learningRate * (pixels / ((double)longest * longest) - m_aspect);
+
+    QMapIterator< QString, int > timing( result.timings );
+    while (timing.hasNext()) {
+        timing.next();
+        QString stage = timing.key() == "classify" ? classifyStage( params.approximate ) : timing.key();
+        double& cost = m_costs[stage];
+        cost += s_learningRate * (timing.value() / megapixels - cost);
+    }
+}
+
+QString DeadlinePlanner::Plan::toString() const
+{
+    return QString("%1px %2 classification, %3 ms predicted%4")
+            .arg( parameters.sizeLimit )
+            .arg( parameters.approximate ? "approximate" : "exact" )
+            .arg( predicted )
+            .arg( refine ? ", refining afterwards" : "" );
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "CountingEngine.hpp"
+
+namespace QArtm {
+
+// Picks how to count a photo so the count is there within a latency budget:
+// the working size, exact or approximate classification, and whether a
+// full quality count has to follow. Costs are learned per stage from the
+// timings of the counts it planned, as ms per working megapixel, starting
+// from guesses for a modest laptop. Safe to use from any thread.
+class DeadlinePlanner {
+public:
+    // working sizes below this don't see the cards at the back
+    static const int MIN_SIZE_LIMIT = 256;
+
+    struct Plan {
+        CountingEngine::Parameters parameters;
+        int predicted;  // ms
+        bool refine;    // parameters are cheaper than the full ones
+        Plan() : predicted(0), refine(false) {}
+
+        QString toString() const;
+    };
+
+    DeadlinePlanner();
+
+    // the cheapest plan falling short of the budget has the smallest size
+    // and approximate classification
+    Plan plan( int budget, const CountingEngine::Parameters& full ) const;
+    void record( const CountingEngine::Parameters& params, const CountingEngine::Result& result );
+
+    // ms the pipeline would take with these parameters
+    int predict( const CountingEngine::Parameters& params ) const;
+
+protected:
+    mutable QMutex m_lock;
+    // ms per working megapixel, keyed like Result::timings with
+    // "classify.approximate" for the bounded search
+    QMap< QString, double > m_costs;
+    // height to width of the working images seen, photos are landscape mostly
+    double m_aspect;
+
+    static QString classifyStage( bool approximate );
+};
+
+}
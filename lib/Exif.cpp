@@ -0,0 +1,106 @@
+#include "Exif.hpp"
+
+using namespace QArtm;
+
+// EXIF lives in APP1 which is at most 64k, possibly after a JFIF APP0
+static const int HEAD_SIZE = 128 * 1024;
+
+Exif::Exif( const QString& path )
+    : m_bigEndian(false)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+    QByteArray head = file.read(HEAD_SIZE);
+    if (head.size() < 4 || uchar(head[0]) != 0xFF || uchar(head[1]) != 0xD8)
+        return;
+
+    // walk the markers until the Exif APP1 or the start of scan
+    int pos = 2;
+    while (pos + 4 <= head.size()) {
+        if (uchar(head[pos]) != 0xFF)
+            return;
+        uchar marker = head[pos + 1];
+        int length = (uchar(head[pos + 2]) << 8) | uchar(head[pos + 3]);
+        if (marker == 0xDA)
+            return;
+        if (marker == 0xE1 && head.mid(pos + 4, 6) == QByteArray("Exif\0\0", 6)) {
+            m_tiff = head.mid(pos + 10, length - 8);
+            break;
+        }
+        pos += 2 + length;
+    }
+
+    if (m_tiff.size() < 8) {
+        m_tiff.clear();
+        return;
+    }
+
+    m_bigEndian = m_tiff.startsWith("MM");
+    quint32 ifd1 = readIfd( u32(4), m_ifd0 );
+    if (ifd1)
+        readIfd( ifd1, m_ifd1 );
+    if (m_ifd0.contains(EXIF_IFD))
+        readIfd( m_ifd0[EXIF_IFD], m_exifIfd );
+}
+
+QByteArray Exif::thumbnail() const
+{
+    if (!m_ifd1.contains(THUMBNAIL_OFFSET) || !m_ifd1.contains(THUMBNAIL_LENGTH))
+        return QByteArray();
+
+    quint32 offset = m_ifd1[THUMBNAIL_OFFSET], length = m_ifd1[THUMBNAIL_LENGTH];
+    // both come from the file, adding them may wrap
+    if (offset > (quint32)m_tiff.size() || (quint32)m_tiff.size() - offset < length)
+        return QByteArray();
+    return m_tiff.mid(offset, length);
+}
+
+QDateTime Exif::dateTimeOriginal() const
+{
+    if (m_exifIfd.contains(DATE_TIME_ORIGINAL))
+        return dateTime( m_exifIfd[DATE_TIME_ORIGINAL] );
+    if (m_ifd0.contains(DATE_TIME))
+        return dateTime( m_ifd0[DATE_TIME] );
+    return QDateTime();
+}
+
+// EXIF dates are "YYYY:MM:DD HH:MM:SS" strings in camera local time
+QDateTime Exif::dateTime( quint32 offset ) const
+{
+    // offset comes from the file, adding to it may wrap
+    if (offset > (quint32)m_tiff.size() || (quint32)m_tiff.size() - offset < 19)
+        return QDateTime();
+    return QDateTime::fromString( QString::fromAscii( m_tiff.constData() + offset, 19 ),
+                                  "yyyy:MM:dd HH:mm:ss" );
+}
+
+quint16 Exif::u16( int offset ) const
+{
+    if (offset < 0 || offset + 2 > m_tiff.size())
+        return 0;
+    const uchar * p = (const uchar *)m_tiff.constData() + offset;
+    return m_bigEndian ? qFromBigEndian<quint16>(p) : qFromLittleEndian<quint16>(p);
+}
+
+quint32 Exif::u32( int offset ) const
+{
+    if (offset < 0 || offset + 4 > m_tiff.size())
+        return 0;
+    const uchar * p = (const uchar *)m_tiff.constData() + offset;
+    return m_bigEndian ? qFromBigEndian<quint32>(p) : qFromLittleEndian<quint32>(p);
+}
+
+// reads entries of the directory at offset, returns offset of the next one
+quint32 Exif::readIfd( quint32 offset, Ifd& ifd ) const
+{
+    int count = u16(offset);
+    for(int i = 0; i < count; i++) {
+        int entry = offset + 2 + i * 12;
+        quint16 tag = u16(entry), type = u16(entry + 2);
+        quint32 n = u32(entry + 4);
+        // values that fit into 4 bytes are stored inline, SHORTs left aligned
+        ifd[tag] = (type == 3 && n == 1) ? u16(entry + 8) : u32(entry + 8);
+    }
+    return u32(offset + 2 + count * 12);
+}
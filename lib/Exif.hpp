@@ -0,0 +1,40 @@
+#pragma once
+
+namespace QArtm {
+
+// Minimal reader for the EXIF block of a JPEG file. Only the APP1 segment at
+// the head of the file is read, the compressed image itself is never touched.
+class Exif {
+public:
+    explicit Exif( const QString& path );
+
+    bool isValid() const { return !m_tiff.isEmpty(); }
+
+    // embedded JPEG thumbnail (IFD1), empty if the camera didn't write one
+    QByteArray thumbnail() const;
+
+    // when the photo was taken according to the camera clock, null if unknown
+    QDateTime dateTimeOriginal() const;
+
+protected:
+    enum Tag {
+        DATE_TIME = 0x0132,
+        THUMBNAIL_OFFSET = 0x0201,
+        THUMBNAIL_LENGTH = 0x0202,
+        EXIF_IFD = 0x8769,
+        DATE_TIME_ORIGINAL = 0x9003
+    };
+
+    typedef QMap< quint16, quint32 > Ifd;
+
+    quint16 u16( int offset ) const;
+    quint32 u32( int offset ) const;
+    quint32 readIfd( quint32 offset, Ifd& ifd ) const;
+    QDateTime dateTime( quint32 offset ) const;
+
+    QByteArray m_tiff;
+    bool m_bigEndian;
+    Ifd m_ifd0, m_ifd1, m_exifIfd;
+};
+
+}
@@ -0,0 +1,62 @@
+#include "ImageLoader.hpp"
+#include "Exif.hpp"
+#include "Pretty.hpp"
+
+using namespace QArtm;
+
+QSize ImageLoader::scaledSize( const QString& path, int sizeLimit )
+{
+    QSize size = QImageReader(path).size();
+    size.scale( sizeLimit, sizeLimit, Qt::KeepAspectRatio );
+    return size;
+}
+
+QImage ImageLoader::scaled( const QString& path, int sizeLimit )
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QImageReader reader(path);
+    QSize source = reader.size();
+    QSize target = source;
+    target.scale( sizeLimit, sizeLimit, Qt::KeepAspectRatio );
+
+    int denom = 1;
+    while (denom < 8 && source.width() / (denom * 2) >= target.width()
+           && source.height() / (denom * 2) >= target.height())
+        denom *= 2;
+    // floor division makes Qt's jpeg handler pick exactly this denominator
+    if (denom > 1)
+        reader.setScaledSize( QSize( source.width() / denom, source.height() / denom ) );
+
+    QImage decoded;
+    if (!reader.read(&decoded)) {
+        qWarning() << "Can't read" << path << reader.errorString();
+        return QImage();
+    }
+    QImage result = decoded.size() == target ? decoded
+                                             : decoded.scaled( target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+
+    qDebug() << qPrintable( QString("Loaded %1 at 1/%2 scale: peak %3 MB instead of %4 MB for a full decode, took %5")
+                            .arg( QFileInfo(path).fileName() ).arg( denom )
+                            .arg( (decoded.byteCount() + result.byteCount()) / 1048576.0, 0, 'f', 1 )
+                            .arg( (source.width() * source.height() * 4 + result.byteCount()) / 1048576.0, 0, 'f', 1 )
+                            .arg( Pretty::ms( timer.elapsed() ) ) );
+    return result;
+}
+
+QImage ImageLoader::preview( const QString& path )
+{
+    QImage img;
+    QByteArray thumbnail = Exif(path).thumbnail();
+    if (!thumbnail.isEmpty() && img.loadFromData(thumbnail, "JPEG"))
+        return img;
+
+    // JPEG decoder can scale down by 1/8 in DCT domain, that's nearly free
+    QImageReader reader(path);
+    QSize size = reader.size();
+    if (size.isValid())
+        reader.setScaledSize( size / 8 );
+    reader.read(&img);
+    return img;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+namespace QArtm {
+
+class ImageLoader {
+public:
+    // size of the image scaled to fit into sizeLimit x sizeLimit, read from the header only
+    static QSize scaledSize( const QString& path, int sizeLimit );
+
+    // a quick low resolution version of the image: the embedded EXIF thumbnail
+    // if there is one, a 1/8 scale decode otherwise
+    static QImage preview( const QString& path );
+
+    // the image scaled to fit into sizeLimit x sizeLimit. JPEGs are decoded at
+    // the strongest 1/2, 1/4 or 1/8 DCT reduction that still covers the target,
+    // so only a small resample is left to do
+    static QImage scaled( const QString& path, int sizeLimit );
+};
+
+}
@@ -9,10 +9,19 @@ struct ImageWidget::Detail {
     QPoint dragStart, dragPos;
     QPen ribbonPen;
 
+    // back buffer, guarded by the mutex since frames may come from any thread
+    QMutex backLock;
+    QImage back;
+    bool presentScheduled;
+
+    // front buffer scaled to the current widget size
+    QImage scaled;
+
     Detail()
         : resizing(false),
         dragging(false),
-        ribbonPen( QBrush(QColor("white")), 1, Qt::DashLine )
+        ribbonPen( QBrush(QColor("white")), 1, Qt::DashLine ),
+        presentScheduled(false)
     {}
 };
 
@@ -35,7 +44,10 @@ void ImageWidget::paintEvent ( QPaintEvent * event )
 
     QPoint targetOffs(0,0);
 
-    painter.drawImage( QRect(targetOffs, targetSize), m_image, m_image.rect());
+    // rescale only when the frame or the widget size changes, not on every paint
+    if (m_detail->scaled.size() != targetSize && !m_image.isNull())
+        m_detail->scaled = m_image.scaled( targetSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+    painter.drawImage( targetOffs, m_detail->scaled );
     painter.save();
     painter.scale( (float)targetSize.width() / m_image.width(),
                    (float)targetSize.height() / m_image.height());
@@ -54,10 +66,31 @@ QSize ImageWidget::sizeHint () const
 }
 
 void ImageWidget::setImage( const QImage& image )
+{
+    QMutexLocker locker( &m_detail->backLock );
+    m_detail->back = image;
+
+    // one present per batch of frames, however many arrive meanwhile
+    if (!m_detail->presentScheduled) {
+        m_detail->presentScheduled = true;
+        QMetaObject::invokeMethod( this, "present", Qt::QueuedConnection );
+    }
+}
+
+void ImageWidget::present()
 {
     QImage old = m_image;
-    m_image = image;
-    if (old.size() != image.size()) {
+    {
+        QMutexLocker locker( &m_detail->backLock );
+        m_detail->presentScheduled = false;
+        if (m_detail->back.isNull())
+            return;
+        m_image = m_detail->back;
+        m_detail->back = QImage();
+    }
+    m_detail->scaled = QImage();
+
+    if (old.size() != m_image.size()) {
         QResizeEvent ev( size(), size() );
         event(&ev);
     }
@@ -6,11 +6,16 @@ class ImageWidget : public QWidget {
 public:
     ImageWidget(QWidget * parent = 0);
     virtual ~ImageWidget();
-    QImage& image() { return m_image; }
+    // the frame on screen; new ones go through setImage()
+    const QImage& image() const { return m_image; }
     QPicture& overlay() { return m_overlay; }
 
 public slots:
+    // may be called from any thread, only the latest pending frame is presented
     void setImage( const QImage& image );
+    // shows the latest pending frame, queued by setImage() on the gui
+    // thread; without one it does nothing
+    void present();
     void setOverlay( const QPicture& overlay ) { m_overlay = overlay; update(); }
     void clearOverlay( ) { m_overlay = QPicture(); }
 
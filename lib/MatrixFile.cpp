@@ -0,0 +1,105 @@
+#include "MatrixFile.hpp"
+
+using namespace QArtm;
+
+static const quint32 VERSION = 1;
+
+namespace {
+
+// Releases the file mapping when the last matrix referring to it goes away.
+// OpenCV calls deallocate() with the refcount we handed out in map().
+class MappedAllocator : public cv::MatAllocator {
+public:
+    void allocate( int, const int *, int, int *&, uchar *&, uchar *&, size_t * )
+    {
+        CV_Error( CV_StsNotImplemented, "mapped matrices can't be reallocated" );
+    }
+
+    void deallocate( int * refcount, uchar * datastart, uchar * )
+    {
+        QMutexLocker locker(&m_lock);
+        delete m_files.take(datastart); // unmaps
+        delete refcount;
+    }
+
+    cv::Mat adopt( QFile * file, const MatrixFile::Header& h, uchar * data )
+    {
+        cv::Mat matrix( h.rows, h.cols, h.type, data, h.step );
+        matrix.refcount = new int(1);
+        matrix.allocator = this;
+
+        QMutexLocker locker(&m_lock);
+        m_files[data] = file;
+        return matrix;
+    }
+
+protected:
+    QMutex m_lock;
+    QHash< uchar *, QFile * > m_files;
+};
+
+MappedAllocator s_allocator;
+
+}
+
+bool MatrixFile::writeTo( QIODevice * device, const cv::Mat& matrix, quint64 key )
+{
+    cv::Mat continuous = matrix.isContinuous() ? matrix : matrix.clone();
+
+    Header h;
+    memset( &h, 0, sizeof(h) );
+    memcpy( h.magic, "VCMX", 4 );
+    h.version = VERSION;
+    h.type = continuous.type();
+    h.rows = continuous.rows;
+    h.cols = continuous.cols;
+    h.step = continuous.cols * continuous.elemSize();
+    h.key = key;
+    qint64 size = (qint64)h.rows * h.step;
+    h.checksum = checksum( continuous.data, size );
+
+    return device->write( (const char *)&h, sizeof(h) ) == sizeof(h)
+            && device->write( (const char *)continuous.data, size ) == size;
+}
+
+qint64 MatrixFile::byteSize( const cv::Mat& matrix )
+{
+    return sizeof(Header) + (qint64)matrix.rows * matrix.cols * matrix.elemSize();
+}
+
+cv::Mat MatrixFile::map( const QString& path, qint64 offset, qint64 size, quint64 key, bool verify )
+{
+    QFile * file = new QFile(path);
+    Header h;
+    if (!file->open(QIODevice::ReadOnly) || !file->seek(offset)
+            || file->read( (char *)&h, sizeof(h) ) != sizeof(h)
+            || memcmp( h.magic, "VCMX", 4 ) || h.version != VERSION || h.key != key
+            || size != (qint64)sizeof(h) + (qint64)h.rows * h.step) {
+        delete file;
+        return cv::Mat();
+    }
+
+    uchar * mapped = file->map( offset, size );
+    if (!mapped || (verify && checksum( mapped + sizeof(h), (qint64)h.rows * h.step ) != h.checksum)) {
+        qWarning() << "Corrupted matrix file" << path;
+        delete file;
+        return cv::Mat();
+    }
+
+    return s_allocator.adopt( file, h, mapped + sizeof(h) );
+}
+
+// FNV-1a over 64 bit words, it has to keep up with memory bandwidth
+quint32 MatrixFile::checksum( const uchar * data, qint64 size )
+{
+    quint64 hash = Q_UINT64_C(14695981039346656037);
+    qint64 words = size / 8;
+    for(qint64 i = 0; i < words; i++) {
+        quint64 word;
+        memcpy( &word, data + i * 8, 8 );
+        hash = (hash ^ word) * Q_UINT64_C(1099511628211);
+    }
+    for(qint64 i = words * 8; i < size; i++)
+        hash = (hash ^ data[i]) * Q_UINT64_C(1099511628211);
+    return (quint32)(hash ^ (hash >> 32));
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+namespace QArtm {
+
+// Raw dump of a cv::Mat behind a small header: type, size, row stride,
+// a key of what it was computed from and a checksum of the pixels. Reading
+// one back is a memory mapping, not a decode.
+class MatrixFile {
+public:
+    struct Header {
+        char magic[4];
+        quint32 version;
+        qint32 type, rows, cols;
+        quint32 step;
+        quint64 key;
+        quint32 checksum;
+        quint32 reserved[7];
+    };
+
+    static bool writeTo( QIODevice * device, const cv::Mat& matrix, quint64 key );
+
+    // maps the matrix stored at offset in the file read only and wraps it
+    // without copying; the mapping lives as long as the matrix (and its
+    // copies) does. Returns an empty matrix if it's missing, for another key
+    // or, when verify is set, doesn't match its checksum. Checksumming reads
+    // every page, so callers verify a record once and trust it afterwards.
+    static cv::Mat map( const QString& path, qint64 offset, qint64 size, quint64 key, bool verify = true );
+
+    // bytes writeTo() produces for the matrix
+    static qint64 byteSize( const cv::Mat& matrix );
+
+    static quint32 checksum( const uchar * data, qint64 size );
+};
+
+}
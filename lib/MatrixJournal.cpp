@@ -0,0 +1,281 @@
+#include "MatrixJournal.hpp"
+#include "CacheArchive.hpp"
+
+using namespace QArtm;
+
+static QDataStream& operator<<( QDataStream& out, const cv::Rect& r )
+{
+    return out << (qint32)r.x << (qint32)r.y << (qint32)r.width << (qint32)r.height;
+}
+
+static QDataStream& operator>>( QDataStream& in, cv::Rect& r )
+{
+    qint32 x, y, w, h;
+    in >> x >> y >> w >> h;
+    r = cv::Rect(x, y, w, h);
+    return in;
+}
+
+MatrixJournal::MatrixJournal( CacheArchive * archive, const QString& path )
+    : m_archive(archive),
+      m_path(path),
+      m_busy(false),
+      m_stopping(false),
+      m_seq(0)
+{
+    QList< Entry > entries = readAll();
+    if (!entries.isEmpty())
+        m_seq = entries.last().seq;
+    foreach(const Entry& entry, entries)
+        index(entry, false);
+
+    m_file.setFileName(path);
+    if (!archive->isReadOnly() && !m_file.open(QIODevice::WriteOnly | QIODevice::Append))
+        qWarning() << "Can't open journal" << path << m_file.errorString();
+
+    start( QThread::LowPriority );
+}
+
+MatrixJournal::~MatrixJournal()
+{
+    stop();
+}
+
+QString MatrixJournal::key( const QByteArray& hash, const QString& name )
+{
+    return QString::fromAscii( hash.toHex() ) + "/" + name;
+}
+
+void MatrixJournal::patch( const QByteArray& hash, const QString& name, const cv::Rect& roi, const cv::Mat& pixels )
+{
+    cv::Mat continuous = pixels.isContinuous() ? pixels : pixels.clone();
+    Entry entry;
+    entry.op = PATCH;
+    entry.hash = hash;
+    entry.name = name;
+    entry.roi = roi;
+    entry.type = continuous.type();
+    entry.pixels = QByteArray( (const char *)continuous.data, continuous.total() * continuous.elemSize() );
+    enqueue(entry);
+}
+
+void MatrixJournal::clear( const QByteArray& hash, const QString& name )
+{
+    Entry entry;
+    entry.op = CLEAR;
+    entry.hash = hash;
+    entry.name = name;
+    entry.type = 0;
+    enqueue(entry);
+}
+
+void MatrixJournal::checkpoint( const QByteArray& hash, const QString& name, const cv::Mat& matrix )
+{
+    Entry entry;
+    entry.op = CHECKPOINT;
+    entry.hash = hash;
+    entry.name = name;
+    entry.type = matrix.type();
+    entry.matrix = matrix;
+    enqueue(entry);
+}
+
+void MatrixJournal::enqueue( Entry entry )
+{
+    // edits can't be kept while another process owns the archive
+    if (m_archive->isReadOnly())
+        return;
+
+    QMutexLocker locker(&m_queueLock);
+    entry.seq = ++m_seq;
+    m_queue.enqueue(entry);
+    index(entry, true);
+    m_queued.wakeOne();
+}
+
+// only what came after the last checkpoint matters, and nothing before a
+// clear; called with m_queueLock held or before the writer starts
+void MatrixJournal::index( const Entry& entry, bool queued )
+{
+    Replay& replay = m_replays[ key(entry.hash, entry.name) ];
+    switch (entry.op) {
+    case CHECKPOINT:
+        replay.checkpoint = entry.seq;
+        replay.pending = queued;
+        replay.matrix = entry.matrix;
+        replay.edits.clear();
+        break;
+    case CLEAR:
+        replay.edits.clear();
+        replay.edits << entry;
+        break;
+    default:
+        replay.edits << entry;
+    }
+}
+
+void MatrixJournal::flush()
+{
+    QMutexLocker locker(&m_queueLock);
+    while (m_busy || !m_queue.isEmpty())
+        m_drained.wait(&m_queueLock);
+}
+
+void MatrixJournal::stop()
+{
+    {
+        QMutexLocker locker(&m_queueLock);
+        m_stopping = true;
+        m_queued.wakeOne();
+    }
+    wait();
+}
+
+void MatrixJournal::run()
+{
+    forever {
+        QList< Entry > batch;
+        {
+            QMutexLocker locker(&m_queueLock);
+            while (m_queue.isEmpty() && !m_stopping)
+                m_queued.wait(&m_queueLock);
+            if (m_queue.isEmpty())
+                return; // stopping, and everything is written
+            while (!m_queue.isEmpty())
+                batch << m_queue.dequeue();
+            m_busy = true;
+        }
+
+        foreach(const Entry& entry, batch) {
+            if (entry.op == CHECKPOINT) {
+                // the matrix first, the marker after it: a crash in between
+                // only means replaying edits that are already in the matrix
+                if (entry.matrix.empty())
+                    m_archive->remove( entry.hash, entry.name );
+                else
+                    m_archive->writeMatrix( entry.hash, entry.name, entry.matrix, 0 );
+
+                // restore reads it from the archive from now on
+                QMutexLocker locker(&m_queueLock);
+                Replay& replay = m_replays[ key(entry.hash, entry.name) ];
+                if (replay.checkpoint == entry.seq) {
+                    replay.pending = false;
+                    replay.matrix = cv::Mat();
+                }
+            }
+            QMutexLocker locker(&m_fileLock);
+            append(m_file, entry);
+        }
+
+        bool large;
+        {
+            QMutexLocker locker(&m_fileLock);
+            m_file.flush();
+            large = m_file.size() > COMPACTION_SIZE;
+        }
+        if (large)
+            compact();
+
+        QMutexLocker locker(&m_queueLock);
+        m_busy = false;
+        m_drained.wakeAll();
+    }
+}
+
+// length prefixed, so a torn last entry is recognized and ignored
+void MatrixJournal::append( QIODevice& device, const Entry& entry )
+{
+    QByteArray record;
+    QDataStream out( &record, QIODevice::WriteOnly );
+    out << entry.seq << entry.op << entry.hash << entry.name << entry.roi << entry.type << entry.pixels;
+
+    QDataStream(&device) << (quint32)record.size();
+    device.write(record);
+}
+
+QList< MatrixJournal::Entry > MatrixJournal::readAll()
+{
+    QList< Entry > entries;
+    QMutexLocker locker(&m_fileLock);
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly))
+        return entries;
+
+    QDataStream in(&file);
+    while (!file.atEnd()) {
+        quint32 size;
+        in >> size;
+        QByteArray record = file.read(size);
+        if (in.status() != QDataStream::Ok || record.size() != (int)size)
+            break;
+        QDataStream rin(record);
+        Entry entry;
+        rin >> entry.seq >> entry.op >> entry.hash >> entry.name >> entry.roi >> entry.type >> entry.pixels;
+        entries << entry;
+    }
+    return entries;
+}
+
+cv::Mat MatrixJournal::restore( const QByteArray& hash, const QString& name, const cv::Size& size, int type )
+{
+    Replay replay;
+    {
+        QMutexLocker locker(&m_queueLock);
+        replay = m_replays.value( key(hash, name) );
+    }
+
+    // masks get drawn on, so they can't stay mapped read only; a checkpoint
+    // still queued isn't in the archive yet
+    cv::Mat matrix = replay.pending ? replay.matrix.clone() : m_archive->readMatrix( hash, name, 0 ).clone();
+    if (!matrix.empty() && (matrix.size() != size || matrix.type() != type))
+        matrix = cv::Mat();
+
+    foreach(const Entry& entry, replay.edits) {
+        if (entry.op == CLEAR) {
+            matrix = cv::Mat();
+            continue;
+        }
+        cv::Rect bounds( cv::Point(0,0), size );
+        if (entry.type != type || (entry.roi & bounds) != entry.roi
+                || entry.pixels.size() != (int)(entry.roi.area() * CV_ELEM_SIZE(type)))
+            continue;
+        if (matrix.empty())
+            matrix = cv::Mat( size, type, cv::Scalar(0) );
+        cv::Mat roi( matrix, entry.roi );
+        cv::Mat( entry.roi.height, entry.roi.width, type, (void *)entry.pixels.constData() ).copyTo( roi );
+    }
+
+    return matrix;
+}
+
+// drops edits covered by a later checkpoint, runs in the writer thread
+void MatrixJournal::compact()
+{
+    QList< Entry > entries = readAll();
+    QHash< QString, quint64 > checkpoints;
+    foreach(const Entry& entry, entries)
+        if (entry.op == CHECKPOINT)
+            checkpoints[ key(entry.hash, entry.name) ] = entry.seq;
+
+    QFile tmp( m_path + ".tmp" );
+    if (!tmp.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Can't compact journal" << m_path << tmp.errorString();
+        return;
+    }
+    int kept = 0;
+    foreach(const Entry& entry, entries) {
+        if (entry.seq <= checkpoints.value( key(entry.hash, entry.name), 0 ))
+            continue;
+        append(tmp, entry);
+        kept++;
+    }
+    tmp.close();
+
+    // nothing else appends while the writer thread is in here
+    QMutexLocker locker(&m_fileLock);
+    m_file.close();
+    QFile::remove(m_path);
+    tmp.rename(m_path);
+    m_file.open( QIODevice::WriteOnly | QIODevice::Append );
+    qDebug() << "Compacted journal" << m_path << "to" << kept << "of" << entries.size() << "entries";
+}
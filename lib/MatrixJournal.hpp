@@ -0,0 +1,83 @@
+#pragma once
+
+namespace QArtm {
+
+class CacheArchive;
+
+// Append-only log of edits to matrices stored in a CacheArchive. Edits are
+// queued and written by a background thread; checkpoints write the whole
+// matrix into the archive from that thread too, after which older edits of
+// that matrix are dropped when the journal gets compacted.
+class MatrixJournal : public QThread {
+    Q_OBJECT
+public:
+    MatrixJournal( CacheArchive * archive, const QString& path );
+    virtual ~MatrixJournal();
+
+    // the roi of the matrix now holds these pixels
+    void patch( const QByteArray& hash, const QString& name, const cv::Rect& roi, const cv::Mat& pixels );
+    // the matrix is gone
+    void clear( const QByteArray& hash, const QString& name );
+    // store the whole matrix (empty to remove it) in the archive
+    void checkpoint( const QByteArray& hash, const QString& name, const cv::Mat& matrix );
+
+    // archived matrix with the journaled edits applied, empty if there's none
+    cv::Mat restore( const QByteArray& hash, const QString& name, const cv::Size& size, int type );
+
+    // blocks until everything queued so far is on disk
+    void flush();
+    void stop();
+
+protected:
+    enum Op {
+        PATCH,
+        CLEAR,
+        CHECKPOINT
+    };
+
+    struct Entry {
+        quint64 seq;
+        qint32 op;
+        QByteArray hash;
+        QString name;
+        cv::Rect roi;
+        qint32 type;
+        QByteArray pixels;
+        cv::Mat matrix; // checkpoints only, not written to the journal
+    };
+
+    // what restore needs of one matrix: its latest checkpoint while that
+    // is still queued, and the edits that came after it
+    struct Replay {
+        quint64 checkpoint;
+        bool pending;
+        cv::Mat matrix;
+        QList< Entry > edits;
+        Replay() : checkpoint(0), pending(false) {}
+    };
+
+    static const qint64 COMPACTION_SIZE = 16 * 1024 * 1024;
+
+    CacheArchive * m_archive;
+    QString m_path;
+    QFile m_file;
+    QMutex m_fileLock;
+
+    QMutex m_queueLock;
+    QWaitCondition m_queued, m_drained;
+    QQueue< Entry > m_queue;
+    bool m_busy, m_stopping;
+    quint64 m_seq;
+    // by key, kept up to date as entries are queued, under m_queueLock
+    QHash< QString, Replay > m_replays;
+
+    virtual void run();
+    void enqueue( Entry entry );
+    void index( const Entry& entry, bool queued );
+    static void append( QIODevice& device, const Entry& entry );
+    QList< Entry > readAll();
+    void compact();
+    static QString key( const QByteArray& hash, const QString& name );
+};
+
+}
@@ -0,0 +1,101 @@
+#include "MatrixRegistry.hpp"
+
+using namespace QArtm;
+
+MatrixRegistry::MatrixRegistry()
+    : m_clock(0),
+      m_budget( std::numeric_limits<qint64>::max() )
+{
+}
+
+void MatrixRegistry::define( const QString& prefix, int type, Recipe recipe, int cost )
+{
+    m_specs[prefix] = Spec( type, recipe, cost );
+}
+
+MatrixRegistry::Spec MatrixRegistry::spec( const QString& name ) const
+{
+    QString best;
+    bool found = false;
+    for(QMap< QString, Spec >::const_iterator it = m_specs.begin(); it != m_specs.end(); ++it) {
+        if (name.startsWith(it.key()) && (!found || it.key().size() > best.size())) {
+            best = it.key();
+            found = true;
+        }
+    }
+    return found ? m_specs[best] : Spec();
+}
+
+qint64 MatrixRegistry::byteSize( const cv::Mat& matrix )
+{
+    return (qint64)matrix.total() * matrix.elemSize();
+}
+
+cv::Mat MatrixRegistry::value( const QString& name )
+{
+    QMap< QString, Entry >::iterator it = m_entries.find(name);
+    if (it == m_entries.end())
+        return cv::Mat();
+    it->used = ++m_clock;
+    return it->matrix;
+}
+
+void MatrixRegistry::insert( const QString& name, const cv::Mat& matrix )
+{
+    int type = spec(name).type;
+    if (type != -1 && !matrix.empty() && matrix.type() != type)
+        qWarning() << "Matrix" << name << "has type" << matrix.type() << "instead of" << type;
+
+    Entry& entry = m_entries[name];
+    entry.matrix = matrix;
+    entry.used = ++m_clock;
+}
+
+qint64 MatrixRegistry::bytes() const
+{
+    qint64 total = 0;
+    foreach(const Entry& entry, m_entries)
+        total += byteSize( entry.matrix );
+    return total;
+}
+
+QStringList MatrixRegistry::evict( const QStringList& busy )
+{
+    QStringList evicted;
+    qint64 total = bytes();
+    if (total <= m_budget)
+        return evicted;
+
+    // cheapest to get back first, least recently used among equals
+    QMap< QPair< int, quint64 >, QString > candidates;
+    for(QMap< QString, Entry >::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+        Spec s = spec( it.key() );
+        if (s.recipe == PINNED || busy.contains( it.key() ))
+            continue;
+        candidates.insert( qMakePair( s.cost, it->used ), it.key() );
+    }
+
+    foreach(const QString& name, candidates) {
+        if (total <= m_budget)
+            break;
+        total -= byteSize( m_entries[name].matrix );
+        m_entries.remove(name);
+        evicted << name;
+    }
+    return evicted;
+}
+
+QString MatrixRegistry::usage() const
+{
+    static const char * recipes[] = { "pinned", "mapped", "computed" };
+
+    QStringList lines;
+    for(QMap< QString, Entry >::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+        const cv::Mat& m = it->matrix;
+        lines << QString("%1 %2x%3 type %4: %5 KB, %6")
+                 .arg( it.key() ).arg( m.cols ).arg( m.rows ).arg( m.type() )
+                 .arg( byteSize(m) / 1024 ).arg( recipes[ spec(it.key()).recipe ] );
+    }
+    lines << QString("total %1 KB of %2 KB").arg( bytes() / 1024 ).arg( m_budget / 1024 );
+    return lines.join("\n");
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+namespace QArtm {
+
+// Named matrices of a snapshot together with what they are: the expected
+// type, how to get one back once it's dropped and roughly what that costs.
+// Keeps track of the bytes held and, when over budget, evicts what's
+// cheapest to get back first, least recently used among equals.
+class MatrixRegistry {
+public:
+    enum Recipe {
+        PINNED,     // edited in place or can't be made again, never evicted
+        MAPPED,     // mapped back from the cache archive
+        COMPUTED    // computed again from other matrices
+    };
+
+    MatrixRegistry();
+
+    // applies to every matrix whose name starts with prefix, the longest
+    // prefix wins; cost is a guess in ms per megapixel, type -1 for any
+    void define( const QString& prefix, int type, Recipe recipe, int cost );
+
+    bool contains( const QString& name ) const { return m_entries.contains(name); }
+    cv::Mat value( const QString& name );
+    void insert( const QString& name, const cv::Mat& matrix );
+    void remove( const QString& name ) { m_entries.remove(name); }
+    QStringList names() const { return m_entries.keys(); }
+
+    qint64 bytes() const;
+    qint64 budget() const { return m_budget; }
+    void setBudget( qint64 bytes ) { m_budget = bytes; }
+
+    // drops matrices until under budget, never the busy ones; returns what went
+    QStringList evict( const QStringList& busy = QStringList() );
+
+    // one line per matrix: name, type, size and recipe, for the log
+    QString usage() const;
+
+protected:
+    struct Spec {
+        int type;
+        Recipe recipe;
+        int cost;
+        Spec() : type(-1), recipe(PINNED), cost(0) {}
+        Spec( int t, Recipe r, int c ) : type(t), recipe(r), cost(c) {}
+    };
+
+    struct Entry {
+        cv::Mat matrix;
+        quint64 used;
+    };
+
+    QMap< QString, Spec > m_specs;
+    QMap< QString, Entry > m_entries;
+    quint64 m_clock;
+    qint64 m_budget;
+
+    Spec spec( const QString& name ) const;
+    static qint64 byteSize( const cv::Mat& matrix );
+};
+
+}
@@ -1,6 +1,34 @@
 #include "QMetaUtilities.hpp"
 
-void QMetaUtilities::connectSlotsByName(QObject * source, QObject * target)
+bool QMetaUtilities::isOwnedBy(const QObject * object, const QObject * owner)
+{
+    for(; object; object = object->parent())
+        if (object == owner)
+            return true;
+    return false;
+}
+
+bool QMetaUtilities::isOwnedByPeer(const QObject * object, const QObject * target)
+{
+    const char * className = target->metaObject()->className();
+    for(; object; object = object->parent())
+        if (object != target && object->inherits(className))
+            return true;
+    return false;
+}
+
+void QMetaUtilities::disconnectSlotsByName(QObject * source, QObject * target)
+{
+    if (!source || !target) return;
+
+    const QObjectList list = source->findChildren<QObject *>(QString()) << source;
+    foreach(QObject * co, list) {
+        if (!isOwnedBy(co, target))
+            QObject::disconnect(co, 0, target, 0);
+    }
+}
+
+void QMetaUtilities::connectSlotsByName(QObject * source, QObject * target, bool foreignOnly)
 {
     if (!source || !target) return;
 
@@ -22,6 +50,10 @@ void QMetaUtilities::connectSlotsByName(QObject * source, QObject * target)
         bool foundIt = false;
         for(int j = 0; j < list.count(); ++j) {
             const QObject *co = list.at(j);
+            if (foreignOnly && isOwnedBy(co, target))
+                continue;
+            if (isOwnedByPeer(co, target))
+                continue;
             const QMetaObject *smo = co->metaObject();
             QByteArray objName = co->objectName().toAscii();
             int len = objName.length();
@@ -52,7 +84,7 @@ void QMetaUtilities::connectSlotsByName(QObject * source, QObject * target)
             // we found our slot, now skip all overloads
             while (target_mo->method(i + 1).attributes() & QMetaMethod::Cloned)
                   ++i;
-        } else if (!(target_mo->method(i).attributes() & QMetaMethod::Cloned)) {
+        } else if (!foreignOnly && !(target_mo->method(i).attributes() & QMetaMethod::Cloned)) {
             qWarning("QMetaObject::connectSlotsByName: No matching signal for %s", slot);
         }
     }
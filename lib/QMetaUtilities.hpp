@@ -4,7 +4,16 @@
 class QMetaUtilities
 {
 public:
-    static void connectSlotsByName(QObject * source, QObject * target);
+    // foreignOnly skips target and its own children, whose connections
+    // disconnectSlotsByName leaves in place. Children of other objects of
+    // target's class are always skipped: their members have the same names
+    // and would shadow the widgets target is meant to find.
+    static void connectSlotsByName(QObject * source, QObject * target, bool foreignOnly = false);
+    static void disconnectSlotsByName(QObject * source, QObject * target);
+
+protected:
+    static bool isOwnedBy(const QObject * object, const QObject * owner);
+    static bool isOwnedByPeer(const QObject * object, const QObject * target);
 };
 
 #endif // QMETAUTILITIES_HPP
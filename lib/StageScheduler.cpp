@@ -0,0 +1,232 @@
+#include "StageScheduler.hpp"
+
+using namespace QArtm;
+
+class StageScheduler::Worker : public QThread {
+public:
+    Worker( StageScheduler * scheduler, int queue )
+        : m_scheduler(scheduler), m_queue(queue) {}
+protected:
+    void run() { m_scheduler->work(m_queue); }
+    StageScheduler * m_scheduler;
+    int m_queue;
+};
+
+StageScheduler::StageScheduler( int workers, QThread::Priority priority, QObject * parent )
+    : QObject(parent),
+      m_nextQueue(0),
+      m_running(0),
+      m_stopping(false),
+      m_paused(false)
+{
+    qRegisterMetaType< StageJobPtr >("QArtm::StageJobPtr");
+
+    for(int i = 0; i < qMax(1, workers); i++) {
+        m_queues << QList< Task >();
+        m_workers << new Worker( this, i );
+        m_workers.last()->start( priority );
+    }
+}
+
+StageScheduler::~StageScheduler()
+{
+    {
+        QMutexLocker locker(&m_lock);
+        m_stopping = true;
+        for(int q = 0; q < m_queues.size(); q++)
+            m_queues[q].clear();
+        m_work.wakeAll();
+    }
+    foreach(Worker * worker, m_workers) {
+        worker->wait();
+        delete worker;
+    }
+    qDeleteAll(m_stages);
+}
+
+void StageScheduler::addStage( Stage * stage )
+{
+    QMutexLocker locker(&m_lock);
+    m_stages << stage;
+    m_stats << StageStats();
+    m_stats.last().name = stage->name();
+}
+
+void StageScheduler::submit( StageJobPtr job )
+{
+    if (m_stages.isEmpty())
+        return;
+
+    Task task;
+    task.job = job;
+    task.stage = 0;
+    task.queued.start();
+
+    // new jobs are spread around, stealing evens out the rest
+    QMutexLocker locker(&m_lock);
+    enqueue( m_nextQueue, task, false );
+    m_nextQueue = (m_nextQueue + 1) % m_queues.size();
+}
+
+void StageScheduler::enqueue( int queue, const Task& task, bool front )
+{
+    if (front)
+        m_queues[queue].prepend(task);
+    else
+        m_queues[queue].append(task);
+    m_stats[task.stage].queued++;
+    m_work.wakeOne();
+}
+
+// own queue and others' from the front; called locked.
+// When paused only tasks of started jobs are taken, wherever they are.
+bool StageScheduler::take( int queue, Task& task )
+{
+    if (m_paused) {
+        for(int i = 0; i < m_queues.size(); i++) {
+            QList< Task >& tasks = m_queues[ (queue + i) % m_queues.size() ];
+            for(int t = 0; t < tasks.size(); t++)
+                if (tasks[t].stage > 0) {
+                    task = tasks.takeAt(t);
+                    m_stats[task.stage].queued--;
+                    m_stats[task.stage].running++;
+                    m_running++;
+                    return true;
+                }
+        }
+        return false;
+    }
+
+    if (!m_queues[queue].isEmpty()) {
+        task = m_queues[queue].takeFirst();
+    } else {
+        int victim = -1;
+        for(int q = 0; q < m_queues.size(); q++)
+            if (!m_queues[q].isEmpty() && (victim < 0 || m_queues[q].size() > m_queues[victim].size()))
+                victim = q;
+        if (victim < 0)
+            return false;
+        task = m_queues[victim].takeFirst();
+    }
+    m_stats[task.stage].queued--;
+    m_stats[task.stage].running++;
+    m_running++;
+    return true;
+}
+
+void StageScheduler::work( int queue )
+{
+    QMutexLocker locker(&m_lock);
+    forever {
+        Task task;
+        while (!m_stopping && !take(queue, task))
+            m_work.wait(&m_lock);
+        if (m_stopping)
+            return;
+
+        int waited = task.queued.elapsed();
+        Stage * stage = m_stages[task.stage];
+        locker.unlock();
+
+        QTime time;
+        time.start();
+        bool ok = stage->process( task.job.data() );
+        int ms = time.elapsed();
+
+        locker.relock();
+        StageStats& s = m_stats[task.stage];
+        s.running--;
+        (ok ? s.done : s.dropped)++;
+        s.totalMs += ms;
+        s.totalWaitMs += waited;
+        s.maxMs = qMax(s.maxMs, ms);
+
+        if (ok && task.stage + 1 < m_stages.size()) {
+            // carry on with the same job right away
+            m_running--;
+            task.stage++;
+            task.queued.start();
+            enqueue( queue, task, true );
+            continue;
+        }
+
+        // unlocked, receivers may call back into the scheduler; the job
+        // still counts as running so that waitForIdle() waits for this
+        locker.unlock();
+        if (ok)
+            emit finished( task.job );
+        else
+            emit dropped( task.job );
+        locker.relock();
+        m_running--;
+
+        if (idle())
+            m_idle.wakeAll();
+    }
+}
+
+// nothing running and nothing that may be started; called locked
+bool StageScheduler::idle() const
+{
+    if (m_running)
+        return false;
+    foreach(const QList< Task >& tasks, m_queues)
+        foreach(const Task& task, tasks)
+            if (!m_paused || task.stage > 0)
+                return false;
+    return true;
+}
+
+void StageScheduler::clear()
+{
+    QMutexLocker locker(&m_lock);
+    for(int q = 0; q < m_queues.size(); q++) {
+        QList< Task >& tasks = m_queues[q];
+        for(int t = tasks.size() - 1; t >= 0; t--)
+            if (tasks[t].stage == 0) {
+                m_stats[0].queued--;
+                tasks.removeAt(t);
+            }
+    }
+    if (idle())
+        m_idle.wakeAll();
+}
+
+// while paused, jobs that haven't started don't count
+void StageScheduler::waitForIdle()
+{
+    QMutexLocker locker(&m_lock);
+    while (!idle())
+        m_idle.wait(&m_lock);
+}
+
+void StageScheduler::setPaused( bool paused )
+{
+    QMutexLocker locker(&m_lock);
+    m_paused = paused;
+    m_work.wakeAll();
+    if (idle())
+        m_idle.wakeAll();
+}
+
+bool StageScheduler::isPaused() const
+{
+    QMutexLocker locker(&m_lock);
+    return m_paused;
+}
+
+QList< StageScheduler::StageStats > StageScheduler::stats() const
+{
+    QMutexLocker locker(&m_lock);
+    return m_stats;
+}
+
+QString StageScheduler::report() const
+{
+    QStringList lines;
+    foreach(const StageStats& s, stats())
+        lines << QString("%1: %2 queued, %3 running, %4 done, %5 dropped, %6 ms average (max %7), %8 ms waiting")
+                 .arg( s.name, -10 ).arg( s.queued ).arg( s.running ).arg( s.done ).arg( s.dropped )
+                 .arg( s.averageMs(), 0, 'f', 1 ).arg( s.maxMs ).arg( s.averageWaitMs(), 0, 'f', 1 );
+    return lines.join("\n");
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+namespace QArtm {
+
+// Whatever travels down the stages, subclassed by the user of the scheduler
+class StageJob {
+public:
+    virtual ~StageJob() {}
+};
+typedef QSharedPointer< StageJob > StageJobPtr;
+
+// A chain of processing stages run by a few worker threads. Every job goes
+// through all stages in order on the worker that started it: the next
+// stage goes to the front of the worker's own queue and is taken again
+// right away, so the job's data stays in the cache and started jobs are
+// never stolen. Between jobs a worker picks fresh ones off the front of its
+// own queue, and once that is empty steals the oldest from the front of
+// the busiest queue. How deep each stage's queue is and how long its work
+// takes is kept for the log. finished() and dropped() are emitted from the
+// worker threads without holding the scheduler's lock.
+class StageScheduler : public QObject {
+    Q_OBJECT
+public:
+    class Stage {
+    public:
+        virtual ~Stage() {}
+        virtual QString name() const = 0;
+        // false drops the job, it doesn't go to the next stage
+        virtual bool process( StageJob * job ) = 0;
+    };
+
+    struct StageStats {
+        QString name;
+        int queued, running;
+        quint64 done, dropped;
+        qint64 totalMs, totalWaitMs;
+        int maxMs;
+        StageStats() : queued(0), running(0), done(0), dropped(0), totalMs(0), totalWaitMs(0), maxMs(0) {}
+        double averageMs() const { return done + dropped ? (double)totalMs / (done + dropped) : 0.0; }
+        double averageWaitMs() const { return done + dropped ? (double)totalWaitMs / (done + dropped) : 0.0; }
+    };
+
+    StageScheduler( int workers, QThread::Priority priority, QObject * parent = 0 );
+    virtual ~StageScheduler();
+
+    // takes ownership; stages are added before the first job is submitted
+    void addStage( Stage * stage );
+
+    void submit( StageJobPtr job );
+    // drops the jobs that haven't started yet, the started ones go on
+    // through their remaining stages
+    void clear();
+    // blocks until nothing is queued or running
+    void waitForIdle();
+
+    // while paused no new job is started, the started ones go on to the end
+    void setPaused( bool paused );
+    bool isPaused() const;
+
+    QList< StageStats > stats() const;
+    QString report() const;
+
+signals:
+    void finished( QArtm::StageJobPtr job );
+    void dropped( QArtm::StageJobPtr job );
+
+protected:
+    struct Task {
+        StageJobPtr job;
+        int stage;
+        QTime queued;
+    };
+
+    class Worker;
+    friend class Worker;
+
+    QList< Stage * > m_stages;
+    QList< Worker * > m_workers;
+    QList< QList< Task > > m_queues; // one per worker
+    QList< StageStats > m_stats;
+    int m_nextQueue;
+    int m_running;
+    bool m_stopping;
+    bool m_paused;
+
+    mutable QMutex m_lock;
+    QWaitCondition m_work, m_idle;
+
+    void enqueue( int queue, const Task& task, bool front );
+    bool take( int queue, Task& task );
+    bool idle() const;
+    void work( int queue );
+};
+
+}
+
+Q_DECLARE_METATYPE( QArtm::StageJobPtr )
@@ -0,0 +1,145 @@
+#include "ThumbnailAtlas.hpp"
+
+using namespace QArtm;
+
+ThumbnailAtlas::ThumbnailAtlas( const QSize& cellSize )
+    : m_cellSize(cellSize)
+{
+    // QImage wants every scanline 32 bit aligned
+    Q_ASSERT( (cellSize.width() * 3) % 4 == 0 );
+}
+
+ThumbnailAtlas::~ThumbnailAtlas()
+{
+    close();
+}
+
+qint64 ThumbnailAtlas::cellBytes() const
+{
+    // key followed by the pixels
+    return sizeof(quint64) + m_cellSize.width() * m_cellSize.height() * 3;
+}
+
+uchar * ThumbnailAtlas::cell( int slot ) const
+{
+    return m_maps.last() + sizeof(Header) + slot * cellBytes();
+}
+
+bool ThumbnailAtlas::open( const QString& path )
+{
+    close();
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::ReadWrite)) {
+        qWarning() << "Can't open thumbnail atlas" << path;
+        return false;
+    }
+
+    Header h;
+    bool compatible = m_file.read( (char *)&h, sizeof(h) ) == sizeof(h)
+            && h.magic == s_magic && h.version == s_version
+            && h.cellWidth == (quint32)m_cellSize.width()
+            && h.cellHeight == (quint32)m_cellSize.height()
+            && m_file.size() >= (qint64)sizeof(Header) + h.capacity * cellBytes();
+
+    if (!compatible) {
+        h.magic = s_magic;
+        h.version = s_version;
+        h.cellWidth = m_cellSize.width();
+        h.cellHeight = m_cellSize.height();
+        h.capacity = h.used = 0;
+        m_file.resize(0);
+        m_file.seek(0);
+        m_file.write( (const char *)&h, sizeof(h) );
+        m_file.flush();
+    }
+
+    if (!map()) {
+        close();
+        return false;
+    }
+
+    for(quint32 slot = 0; slot < header()->used; slot++)
+        m_slots[ *(quint64 *)cell(slot) ] = slot;
+    return true;
+}
+
+void ThumbnailAtlas::close()
+{
+    foreach(uchar * mapped, m_maps)
+        m_file.unmap(mapped);
+    m_maps.clear();
+    m_slots.clear();
+    m_file.close();
+}
+
+// images handed out may still point into the older mappings, so they stay
+// mapped until the atlas is closed
+bool ThumbnailAtlas::map()
+{
+    uchar * mapped = m_file.map( 0, m_file.size() );
+    if (!mapped) {
+        qWarning() << "Can't map thumbnail atlas" << m_file.fileName() << m_file.errorString();
+        return false;
+    }
+    m_maps << mapped;
+    return true;
+}
+
+bool ThumbnailAtlas::grow()
+{
+    quint32 capacity = qMax( 64u, header()->capacity * 2 );
+    if (!m_file.resize( sizeof(Header) + capacity * cellBytes() ) || !map())
+        return false;
+    header()->capacity = capacity;
+    return true;
+}
+
+QImage ThumbnailAtlas::image( quint64 key ) const
+{
+    if (!m_slots.contains(key))
+        return QImage();
+    return QImage( (const uchar *)cell( m_slots[key] ) + sizeof(quint64),
+                   m_cellSize.width(), m_cellSize.height(), QImage::Format_RGB888 );
+}
+
+void ThumbnailAtlas::store( quint64 key, const QImage& image )
+{
+    if (m_maps.isEmpty())
+        return;
+
+    int slot;
+    if (m_slots.contains(key)) {
+        slot = m_slots[key];
+    } else {
+        if (header()->used == header()->capacity && !grow())
+            return;
+        slot = header()->used;
+    }
+
+    // letterbox the image into the cell
+    QImage pixels( cell(slot) + sizeof(quint64),
+                   m_cellSize.width(), m_cellSize.height(), QImage::Format_RGB888 );
+    pixels.fill(0);
+    QImage scaled = image.scaled( m_cellSize, Qt::KeepAspectRatio, Qt::SmoothTransformation )
+            .convertToFormat( QImage::Format_RGB888 );
+    QPoint offset( (m_cellSize.width() - scaled.width()) / 2,
+                   (m_cellSize.height() - scaled.height()) / 2 );
+    for(int y = 0; y < scaled.height(); y++)
+        memcpy( pixels.scanLine(offset.y() + y) + offset.x() * 3,
+                scaled.constScanLine(y), scaled.width() * 3 );
+
+    *(quint64 *)cell(slot) = key;
+    if (!m_slots.contains(key)) {
+        m_slots[key] = slot;
+        header()->used++;
+    }
+}
+
+quint64 ThumbnailAtlas::key( const QString& name, qint64 size, const QDateTime& modified )
+{
+    QCryptographicHash hash( QCryptographicHash::Md5 );
+    hash.addData( name.toUtf8() );
+    hash.addData( QByteArray::number(size) );
+    hash.addData( QByteArray::number( modified.toTime_t() ) );
+    return qFromLittleEndian<quint64>( (const uchar *)hash.result().constData() );
+}
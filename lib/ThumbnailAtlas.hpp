@@ -0,0 +1,47 @@
+#pragma once
+
+namespace QArtm {
+
+// Fixed size RGB thumbnails packed into a single memory mapped file.
+// Cells are addressed by a 64 bit key; images handed out wrap the mapped
+// memory directly, so showing a thumbnail never decodes anything.
+class ThumbnailAtlas {
+public:
+    explicit ThumbnailAtlas( const QSize& cellSize );
+    ~ThumbnailAtlas();
+
+    // opens or creates the atlas, an incompatible one is started over
+    bool open( const QString& path );
+    void close();
+
+    QSize cellSize() const { return m_cellSize; }
+    bool contains( quint64 key ) const { return m_slots.contains(key); }
+    QImage image( quint64 key ) const;
+    void store( quint64 key, const QImage& image );
+
+    static quint64 key( const QString& name, qint64 size, const QDateTime& modified );
+
+protected:
+    struct Header {
+        quint32 magic, version;
+        quint32 cellWidth, cellHeight;
+        quint32 capacity, used;
+        quint32 reserved[2];
+    };
+
+    static const quint32 s_magic = 0x56435441; // "VCTA"
+    static const quint32 s_version = 1;
+
+    QSize m_cellSize;
+    QFile m_file;
+    QList< uchar * > m_maps;
+    QHash< quint64, int > m_slots;
+
+    Header * header() const { return (Header *)m_maps.last(); }
+    qint64 cellBytes() const;
+    uchar * cell( int slot ) const;
+    bool map();
+    bool grow();
+};
+
+}
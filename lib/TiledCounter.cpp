@@ -0,0 +1,261 @@
+#include "TiledCounter.hpp"
+#include "BufferPool.hpp"
+
+using namespace QArtm;
+
+TiledCounter::TiledCounter( const CountingEngine& engine )
+    : m_engine(&engine)
+{
+}
+
+bool TiledCounter::count( const QString& path, const CountingEngine::Parameters& params,
+                          CountingEngine::Result& result ) const
+{
+    cv::Mat colors = cardColors( path, params.threshold, result.timings );
+    if (colors.empty())
+        return false;
+
+    // the smallest card is set on the working image
+    int longest = qMax( colors.rows, colors.cols );
+    int sizeFilter = qMax( 1, qRound( params.sizeFilter * (double)longest / qMin( longest, params.sizeLimit ) ) );
+
+    QTime time;
+    time.start();
+    result.threshold = params.threshold;
+    result.sizeFilter = sizeFilter;
+    result.cards = cards( colors, sizeFilter );
+    result.timings["count"] += time.elapsed();
+
+    // Qt decodes JPEG to 32 bit RGB
+    cv::Range band = bandRows( 0, colors.rows );
+    qDebug() << qPrintable( QString("Counted %1 at %2x%3 in %4 px tiles, %5 MB of card colors and %6 MB a band")
+                            .arg( QFileInfo(path).fileName() ).arg( colors.cols ).arg( colors.rows )
+                            .arg( TILE_SIZE )
+                            .arg( colors.total() * colors.elemSize() / 1048576.0, 0, 'f', 1 )
+                            .arg( band.size() * colors.cols * 4 / 1048576.0, 0, 'f', 1 ) );
+    return true;
+}
+
+cv::Mat TiledCounter::cardColors( const cv::Mat& rgb, int threshold, QMap< QString, int >& timings ) const
+{
+    cv::Mat colors( rgb.rows, rgb.cols, CV_8UC1, cv::Scalar(0) );
+    for(int y = 0; y < rgb.rows; y += TILE_SIZE)
+        classifyBand( rgb.rowRange( bandRows( y, rgb.rows ) ), y, threshold, colors, timings );
+    clearBorder( colors );
+    return colors;
+}
+
+// Qt's JPEG handler decodes a clip rect scanline by scanline, keeping only
+// the rows inside it. The rows above are decoded again for every band,
+// which costs time, not memory.
+cv::Mat TiledCounter::cardColors( const QString& path, int threshold, QMap< QString, int >& timings ) const
+{
+    QSize size = QImageReader(path).size();
+    if (!size.isValid()) {
+        qWarning() << "Can't read" << path;
+        return cv::Mat();
+    }
+
+    cv::Mat colors( size.height(), size.width(), CV_8UC1, cv::Scalar(0) );
+    QTime time;
+    for(int y = 0; y < size.height(); y += TILE_SIZE) {
+        time.start();
+        cv::Range rows = bandRows( y, size.height() );
+        QImageReader reader(path);
+        reader.setClipRect( QRect( 0, rows.start, size.width(), rows.size() ) );
+        QImage decoded;
+        if (!reader.read(&decoded) || decoded.size() != QSize( size.width(), rows.size() )) {
+            qWarning() << "Can't read" << path << reader.errorString();
+            return cv::Mat();
+        }
+        decoded = decoded.convertToFormat(QImage::Format_RGB888);
+        cv::Mat rgb( decoded.height(), decoded.width(), CV_8UC3, (void*)decoded.constBits(), decoded.bytesPerLine() );
+        timings["decode"] += time.elapsed();
+
+        classifyBand( rgb, y, threshold, colors, timings );
+    }
+    clearBorder( colors );
+    return colors;
+}
+
+cv::Range TiledCounter::bandRows( int y, int rows )
+{
+    return cv::Range( qMax( 0, y - MARGIN ), qMin( rows, y + TILE_SIZE + MARGIN ) );
+}
+
+void TiledCounter::classifyBand( const cv::Mat& rgb, int y, int threshold, cv::Mat& colors,
+                                 QMap< QString, int >& timings ) const
+{
+    cv::Rect image( 0, 0, colors.cols, colors.rows );
+    int top = bandRows( y, colors.rows ).start;
+
+    int labTime = 0, classifyTime = 0, maskTime = 0;
+    QTime time;
+    time.start();
+    for(int x = 0; x < colors.cols; x += TILE_SIZE) {
+        cv::Rect core( x, y, std::min(TILE_SIZE, colors.cols - x), std::min(TILE_SIZE, colors.rows - y) );
+        cv::Rect padded( core.x - MARGIN, core.y - MARGIN, core.width + 2 * MARGIN, core.height + 2 * MARGIN );
+        padded &= image;
+
+        cv::Mat lab = CountingEngine::toLab( cv::Mat(rgb, padded - cv::Point(0, top)) );
+        labTime += time.restart();
+        cv::Mat indices, dists;
+        m_engine->classify( lab, indices, dists );
+        lab = cv::Mat();
+        classifyTime += time.restart();
+
+        QVector< cv::Mat > masks = CountingEngine::cardMasks( indices, dists, threshold );
+        cv::Rect inner( core.x - padded.x, core.y - padded.y, core.width, core.height );
+        cv::Mat coreColors( colors, core );
+        for(int i = 0; i < masks.size(); i++)
+            coreColors.setTo( cv::Scalar(i + 1), cv::Mat(masks[i], inner) );
+        maskTime += time.restart();
+    }
+
+    timings["lab"] += labTime;
+    timings["classify"] += classifyTime;
+    timings["count"] += maskTime;
+}
+
+void TiledCounter::clearBorder( cv::Mat& colors )
+{
+    colors.row(0).setTo( cv::Scalar(0) );
+    colors.row(colors.rows - 1).setTo( cv::Scalar(0) );
+    colors.col(0).setTo( cv::Scalar(0) );
+    colors.col(colors.cols - 1).setTo( cv::Scalar(0) );
+}
+
+QVector< CountingEngine::Contours > TiledCounter::cards( const cv::Mat& colors, int sizeFilter )
+{
+    cv::Rect image( 0, 0, colors.cols, colors.rows );
+    double minSize = sizeFilter * sizeFilter;
+    BufferPool * pool = BufferPool::instance();
+
+    // per card color: cards within one tile, and cards reaching past their
+    // tile traced whole, approximated as cardContours does and pixel exact
+    QVector< CountingEngine::Contours > inTile( CountingEngine::CARD_COLORS ),
+            stitched( CountingEngine::CARD_COLORS ), stitchedExact( CountingEngine::CARD_COLORS );
+
+    foreach(const cv::Rect& tile, tiles( colors.size() )) {
+        for(int color = 0; color < CountingEngine::CARD_COLORS; color++) {
+            cv::Mat scratch = pool->matrix( tile.height + 2, tile.width + 2, CV_8UC1, cv::Scalar(0) );
+            cv::Mat inner( scratch, cv::Rect( 1, 1, tile.width, tile.height ) );
+            cv::compare( cv::Mat(colors, tile), cv::Scalar(color + 1), inner, cv::CMP_EQ );
+            CountingEngine::Contours contours;
+            cv::findContours( scratch, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_TC89_L1,
+                              tile.tl() - cv::Point(1, 1) );
+
+            for(size_t i = 0; i < contours.size(); i++) {
+                cv::Rect bounds = cv::boundingRect( contours[i] );
+                bool crossing = (bounds.x == tile.x && tile.x > 0)
+                        || (bounds.y == tile.y && tile.y > 0)
+                        || (bounds.br().x == tile.br().x && tile.br().x < image.width)
+                        || (bounds.br().y == tile.br().y && tile.br().y < image.height);
+                if (!crossing) {
+                    if (cv::contourArea( contours[i] ) >= minSize)
+                        inTile[color].push_back( contours[i] );
+                    continue;
+                }
+
+                // the other pieces of a card traced already
+                cv::Point seed = contours[i][0];
+                bool traced = false;
+                for(size_t j = 0; j < stitchedExact[color].size() && !traced; j++)
+                    traced = cv::boundingRect( stitchedExact[color][j] ).contains( seed )
+                            && cv::pointPolygonTest( stitchedExact[color][j], seed, false ) >= 0;
+                if (traced)
+                    continue;
+
+                CountingEngine::Contour exact;
+                CountingEngine::Contour outline = traceAround( colors, color + 1, bounds, seed, &exact );
+                if (outline.empty())
+                    continue;
+                stitched[color].push_back( outline );
+                stitchedExact[color].push_back( exact );
+            }
+        }
+    }
+
+    // whatever lies in the hole of a stitched card isn't an outer contour
+    // of the whole image, as it didn't look like one within its own tile
+    QVector< CountingEngine::Contours > result( CountingEngine::CARD_COLORS );
+    for(int color = 0; color < CountingEngine::CARD_COLORS; color++) {
+        const CountingEngine::Contours& enclosing = stitchedExact[color];
+        for(int pass = 0; pass < 2; pass++) {
+            const CountingEngine::Contours& candidates = pass ? stitched[color] : inTile[color];
+            for(size_t i = 0; i < candidates.size(); i++) {
+                if (pass && cv::contourArea( candidates[i] ) < minSize)
+                    continue;
+                bool enclosed = false;
+                for(size_t j = 0; j < enclosing.size() && !enclosed; j++)
+                    enclosed = !(pass && i == j)
+                            && cv::boundingRect( enclosing[j] ).contains( candidates[i][0] )
+                            && cv::pointPolygonTest( enclosing[j], candidates[i][0], false ) > 0;
+                if (!enclosed)
+                    result[color].push_back( candidates[i] );
+            }
+        }
+    }
+    return result;
+}
+
+// Traced twice: pixel exact to tell which contour the seed belongs to, and
+// approximated like cardContours for the area. Both list the contours in
+// the same order.
+CountingEngine::Contour TiledCounter::traceAround( const cv::Mat& colors, int color, cv::Rect box,
+                                                   const cv::Point& seed, CountingEngine::Contour * exact )
+{
+    cv::Rect image( 0, 0, colors.cols, colors.rows );
+    BufferPool * pool = BufferPool::instance();
+    forever {
+        box &= image;
+        cv::Mat scratch = pool->matrix( box.height + 2, box.width + 2, CV_8UC1, cv::Scalar(0) );
+        cv::Mat inner( scratch, cv::Rect( 1, 1, box.width, box.height ) );
+        cv::compare( cv::Mat(colors, box), cv::Scalar(color), inner, cv::CMP_EQ );
+        cv::Mat scratch2 = pool->matrix( scratch.rows, scratch.cols, CV_8UC1 );
+        scratch.copyTo( scratch2 );
+
+        cv::Point offset = box.tl() - cv::Point(1, 1);
+        CountingEngine::Contours pixels, outlines;
+        cv::findContours( scratch, pixels, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE, offset );
+        cv::findContours( scratch2, outlines, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_TC89_L1, offset );
+
+        int found = -1;
+        for(size_t i = 0; i < pixels.size() && found < 0; i++)
+            if (cv::pointPolygonTest( pixels[i], seed, false ) >= 0)
+                found = i;
+        if (found < 0 || found >= (int)outlines.size())
+            return CountingEngine::Contour();
+
+        // it goes on past the box, unless the box is at the edge of the image
+        cv::Rect bounds = cv::boundingRect( pixels[found] );
+        cv::Rect grown = box;
+        if (bounds.x == box.x && box.x > 0) {
+            grown.x -= TILE_SIZE;
+            grown.width += TILE_SIZE;
+        }
+        if (bounds.y == box.y && box.y > 0) {
+            grown.y -= TILE_SIZE;
+            grown.height += TILE_SIZE;
+        }
+        if (bounds.br().x == box.br().x && box.br().x < image.width)
+            grown.width += TILE_SIZE;
+        if (bounds.br().y == box.br().y && box.br().y < image.height)
+            grown.height += TILE_SIZE;
+        if ((grown & image) == box) {
+            if (exact)
+                *exact = pixels[found];
+            return outlines[found];
+        }
+        box = grown;
+    }
+}
+
+QList< cv::Rect > TiledCounter::tiles( const cv::Size& size )
+{
+    QList< cv::Rect > result;
+    for(int y = 0; y < size.height; y += TILE_SIZE)
+        for(int x = 0; x < size.width; x += TILE_SIZE)
+            result << cv::Rect( x, y, std::min(TILE_SIZE, size.width - x), std::min(TILE_SIZE, size.height - y) );
+    return result;
+}
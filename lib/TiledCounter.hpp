@@ -0,0 +1,58 @@
+#pragma once
+
+#include "CountingEngine.hpp"
+
+namespace QArtm {
+
+// Counts the cards of a photo at its full camera resolution. The photo is
+// decoded a band of tiles at a time, and the float stages, Lab, indices,
+// distances and the thresholded difference, only ever exist for one tile;
+// what's kept for the whole photo is one byte per pixel for the card color
+// it was classified as.
+//
+// Tiles overlap by MARGIN so the opened masks of their cores are exactly
+// those of the whole image. Cards are traced per tile, and the ones that
+// reach into a neighbour are traced again over the union of the tiles
+// they cover, so counts and contours match a whole image run.
+class TiledCounter {
+public:
+    static const int TILE_SIZE = 1024;
+    // morphological opening with a 3x3 kernel reaches 2 pixels
+    static const int MARGIN = 4;
+
+    explicit TiledCounter( const CountingEngine& engine );
+
+    // params.sizeFilter is taken at params.sizeLimit and scaled up to the
+    // photo; the result has cards and timings but no matrices
+    bool count( const QString& path, const CountingEngine::Parameters& params,
+                CountingEngine::Result& result ) const;
+
+    // the card colors of a photo, 1 + the color index, 0 for none
+    cv::Mat cardColors( const cv::Mat& rgb, int threshold, QMap< QString, int >& timings ) const;
+    // the same decoding the photo band by band, empty if it can't be read
+    cv::Mat cardColors( const QString& path, int threshold, QMap< QString, int >& timings ) const;
+    // the cards of a card colors map, traced tile by tile and stitched
+    static QVector< CountingEngine::Contours > cards( const cv::Mat& colors, int sizeFilter );
+
+protected:
+    const CountingEngine * m_engine;
+
+    // the rows of the photo a band of tiles starting at row y needs
+    static cv::Range bandRows( int y, int rows );
+    // classifies the tiles of the band at row y into colors, rgb holds the
+    // rows bandRows gives for it
+    void classifyBand( const cv::Mat& rgb, int y, int threshold, cv::Mat& colors,
+                       QMap< QString, int >& timings ) const;
+    // findContours ignores the outermost pixels of the whole image mask,
+    // and tiles are traced with a border of their own
+    static void clearBorder( cv::Mat& colors );
+
+    // the outer contour through seed, traced within box and grown until it
+    // doesn't touch the box's edges any more
+    static CountingEngine::Contour traceAround( const cv::Mat& colors, int color,
+                                                cv::Rect box, const cv::Point& seed,
+                                                CountingEngine::Contour * exact = 0 );
+    static QList< cv::Rect > tiles( const cv::Size& size );
+};
+
+}
@@ -0,0 +1,33 @@
+#ifndef SCRATCHDIRECTORY_H
+#define SCRATCHDIRECTORY_H
+
+// An empty directory under the system temp dir for the files of one test,
+// removed again with everything in it
+class ScratchDirectory {
+public:
+    explicit ScratchDirectory( const QString& name )
+        : m_dir( QDir::temp().filePath( QString("qartm-%1-%2").arg(name).arg( QCoreApplication::applicationPid() ) ) )
+    {
+        clear();
+        QDir::temp().mkpath( m_dir.path() );
+    }
+
+    ~ScratchDirectory()
+    {
+        clear();
+        QDir::temp().rmdir( m_dir.path() );
+    }
+
+    QString filePath( const QString& name ) const { return m_dir.filePath(name); }
+
+protected:
+    QDir m_dir;
+
+    void clear()
+    {
+        foreach(QString name, m_dir.entryList( QDir::Files | QDir::Hidden ))
+            m_dir.remove(name);
+    }
+};
+
+#endif // SCRATCHDIRECTORY_H
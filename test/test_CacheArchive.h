@@ -0,0 +1,137 @@
+#include <cxxtest/TestSuite.h>
+
+#include "CacheArchive.hpp"
+#include "ScratchDirectory.h"
+
+using namespace QArtm;
+
+class CacheArchiveTest : public CxxTest::TestSuite {
+public:
+    void setUp()
+    {
+        m_scratch = new ScratchDirectory("CacheArchiveTest");
+        m_path = m_scratch->filePath("cache.vca");
+        m_hash = QCryptographicHash::hash( "photo", QCryptographicHash::Sha1 );
+    }
+
+    void tearDown()
+    {
+        delete m_scratch;
+    }
+
+    // records appended after the saved index are found again, a torn one
+    // at the end is cut off
+    void testTailScanAfterCrash()
+    {
+        QString index = m_scratch->filePath("cache.vci");
+        {
+            CacheArchive archive;
+            TS_ASSERT( archive.open(m_path) );
+            TS_ASSERT( archive.write( m_hash, "a", "first" ) );
+            TS_ASSERT( archive.write( m_hash, "b", "second" ) );
+        }
+        TS_ASSERT( QFile::exists(index) );
+        TS_ASSERT( QFile::copy( index, index + ".stale" ) );
+        {
+            CacheArchive archive;
+            TS_ASSERT( archive.open(m_path) );
+            TS_ASSERT( archive.write( m_hash, "c", "third" ) );
+            TS_ASSERT( archive.write( m_hash, "a", "replaced" ) );
+        }
+
+        // the crash: the index is from before the second session, which
+        // was in the middle of appending a record
+        QFile::remove(index);
+        TS_ASSERT( QFile::rename( index + ".stale", index ) );
+        QFile file(m_path);
+        TS_ASSERT( file.open(QIODevice::ReadWrite) );
+        qint64 torn = (file.size() + 63) / 64 * 64;
+        QByteArray header( "VCAR" );
+        quint32 keyLength = 1;
+        qint64 payloadSize = 1000;
+        header.append( (const char *)&keyLength, sizeof(keyLength) );
+        header.append( (const char *)&payloadSize, sizeof(payloadSize) );
+        TS_ASSERT( file.seek(torn) );
+        TS_ASSERT_EQUALS( file.write( header + "x" ), header.size() + 1 );
+        file.close();
+
+        CacheArchive archive;
+        TS_ASSERT( archive.open(m_path) );
+        TS_ASSERT_EQUALS( archive.read( m_hash, "a" ), QByteArray("replaced") );
+        TS_ASSERT_EQUALS( archive.read( m_hash, "b" ), QByteArray("second") );
+        TS_ASSERT_EQUALS( archive.read( m_hash, "c" ), QByteArray("third") );
+        TS_ASSERT_EQUALS( archive.size(), torn );
+        TS_ASSERT( archive.garbage() > 0 );
+
+        // and appending goes on where the intact records end
+        TS_ASSERT( archive.write( m_hash, "d", "fourth" ) );
+        TS_ASSERT_EQUALS( archive.read( m_hash, "d" ), QByteArray("fourth") );
+    }
+
+    // superseded records go, the live ones survive with their contents
+    void testCompaction()
+    {
+        cv::Mat matrix( 64, 48, CV_16UC1 );
+        cv::randu( matrix, cv::Scalar(0), cv::Scalar(65535) );
+        const int megabyte = 1024 * 1024, writes = 48;
+        {
+            CacheArchive archive;
+            TS_ASSERT( archive.open(m_path) );
+            TS_ASSERT( archive.writeMatrix( m_hash, "matrix", matrix, 42 ) );
+            for(int i = 0; i < writes; i++)
+                TS_ASSERT( archive.write( m_hash, "big", QByteArray( megabyte, 'a' + i % 26 ) ) );
+        }
+
+        CacheArchive archive;
+        TS_ASSERT( archive.open(m_path) );
+        TS_ASSERT( archive.size() < writes * megabyte / 2 );
+        TS_ASSERT_EQUALS( archive.read( m_hash, "big" ), QByteArray( megabyte, 'a' + (writes - 1) % 26 ) );
+        cv::Mat read = archive.readMatrix( m_hash, "matrix", 42 );
+        TS_ASSERT_EQUALS( read.size(), matrix.size() );
+        TS_ASSERT_EQUALS( read.type(), matrix.type() );
+        TS_ASSERT_EQUALS( cv::countNonZero( read != matrix ), 0 );
+        TS_ASSERT( archive.readMatrix( m_hash, "matrix", 43 ).empty() );
+        TS_ASSERT( !QFile::exists( m_path + ".compact" ) );
+    }
+
+    void testSecondWriterOpensReadOnly()
+    {
+        CacheArchive writer, reader;
+        TS_ASSERT( writer.open(m_path) );
+        TS_ASSERT( writer.write( m_hash, "a", "first" ) );
+        TS_ASSERT( !writer.isReadOnly() );
+
+        TS_ASSERT( reader.open(m_path) );
+        TS_ASSERT( reader.isReadOnly() );
+        TS_ASSERT_EQUALS( reader.read( m_hash, "a" ), QByteArray("first") );
+        TS_ASSERT( !reader.write( m_hash, "b", "second" ) );
+    }
+
+    // a read only archive sees what the writer appends, also once the
+    // writer compacted it into a new file
+    void testReaderFollowsCompaction()
+    {
+        const int megabyte = 1024 * 1024, writes = 48;
+        CacheArchive writer, reader;
+        TS_ASSERT( writer.open(m_path) );
+        TS_ASSERT( reader.open(m_path) );
+        TS_ASSERT( reader.isReadOnly() );
+
+        TS_ASSERT( writer.write( m_hash, "a", "first" ) );
+        TS_ASSERT_EQUALS( reader.read( m_hash, "a" ), QByteArray("first") );
+
+        for(int i = 0; i < writes; i++)
+            TS_ASSERT( writer.write( m_hash, "big", QByteArray( megabyte, 'a' + i % 26 ) ) );
+        // waits for the compaction
+        writer.close();
+
+        TS_ASSERT_EQUALS( reader.read( m_hash, "big" ), QByteArray( megabyte, 'a' + (writes - 1) % 26 ) );
+        TS_ASSERT_EQUALS( reader.read( m_hash, "a" ), QByteArray("first") );
+        TS_ASSERT( reader.size() < writes * megabyte / 2 );
+    }
+
+protected:
+    ScratchDirectory * m_scratch;
+    QString m_path;
+    QByteArray m_hash;
+};
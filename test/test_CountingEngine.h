@@ -0,0 +1,75 @@
+#include <cxxtest/TestSuite.h>
+
+#include "CountingEngine.hpp"
+#include "CacheArchive.hpp"
+#include "ScratchDirectory.h"
+
+using namespace QArtm;
+
+class CountingEngineTest : public CxxTest::TestSuite {
+public:
+    void setUp()
+    {
+        m_scratch = new ScratchDirectory("CountingEngineTest");
+
+        // a patch of each card color to learn the palette from, noisy so
+        // there are gradations to learn
+        QList< cv::Scalar > colors;
+        colors << cv::Scalar( 40, 170, 60 ) << cv::Scalar( 230, 90, 160 ) << cv::Scalar( 240, 220, 40 );
+        cv::Mat training( 60, 60 * CountingEngine::CARD_COLORS, CV_8UC3 );
+        QList< cv::Mat > masks;
+        for(int color = 0; color < CountingEngine::CARD_COLORS; color++) {
+            cv::Rect patch( 60 * color, 0, 60, 60 );
+            training( patch ).setTo( colors[color] );
+            masks << cv::Mat( training.size(), CV_8UC1, cv::Scalar(0) );
+            masks.last()( patch ).setTo( cv::Scalar(1) );
+        }
+        cv::Mat noise( training.size(), CV_8UC3 );
+        cv::randu( noise, cv::Scalar::all(0), cv::Scalar::all(12) );
+        training += noise;
+        m_engine = new CountingEngine;
+        m_engine->setPalette( CountingEngine::learnPalette( CountingEngine::toLab(training), masks ) );
+    }
+
+    void tearDown()
+    {
+        delete m_engine;
+        delete m_scratch;
+    }
+
+    // one tile of a tripod series brightens a little from photo to photo,
+    // each step within the tolerance; it's classified again once it has
+    // drifted too far from the photo its classification was copied from
+    void testDriftingTileIsReclassified()
+    {
+        QSharedPointer< CacheArchive > archive( new CacheArchive );
+        TS_ASSERT( archive->open( m_scratch->filePath("cache.vca") ) );
+
+        const int size = 2 * CountingEngine::TILE_SIZE, step = CountingEngine::FINGERPRINT_TOLERANCE / 2;
+        quint64 key = m_engine->classificationKey( size );
+        QList<int> reused;
+        for(int frame = 0; frame < 4; frame++) {
+            cv::Mat input( size, size, CV_8UC3, cv::Scalar( 128, 128, 128 ) );
+            input( cv::Rect( 0, 0, CountingEngine::TILE_SIZE, CountingEngine::TILE_SIZE ) )
+                    .setTo( cv::Scalar::all( 100 + step * frame ) );
+            QByteArray hash = QCryptographicHash::hash( QString("frame %1").arg(frame).toUtf8(),
+                                                        QCryptographicHash::Sha1 );
+
+            cv::Mat prints = CountingEngine::fingerprints( input );
+            cv::Mat lab = CountingEngine::toLab( input );
+            CountingEngine::Reference reference;
+            CountingEngine::loadReference( archive, hash, key, prints, lab.size(), reference );
+            cv::Mat indices, dists;
+            reused << m_engine->classify( lab, prints, reference, indices, dists );
+            TS_ASSERT( CountingEngine::saveClassification( archive, hash, indices, dists, key ) );
+            TS_ASSERT( CountingEngine::saveFingerprints( archive, hash, prints, key ) );
+        }
+
+        // drifted by 1, 2 and then 3 steps from the first photo
+        TS_ASSERT_EQUALS( reused, QList<int>() << 0 << 4 << 4 << 3 );
+    }
+
+protected:
+    ScratchDirectory * m_scratch;
+    CountingEngine * m_engine;
+};
@@ -0,0 +1,108 @@
+#include <cxxtest/TestSuite.h>
+
+#include "CacheArchive.hpp"
+#include "MatrixJournal.hpp"
+#include "ScratchDirectory.h"
+
+using namespace QArtm;
+
+class MatrixJournalTest : public CxxTest::TestSuite {
+public:
+    void setUp()
+    {
+        m_scratch = new ScratchDirectory("MatrixJournalTest");
+        m_path = m_scratch->filePath("cache.vca");
+        m_hash = QCryptographicHash::hash( "photo", QCryptographicHash::Sha1 );
+        m_size = cv::Size( 32, 32 );
+    }
+
+    void tearDown()
+    {
+        delete m_scratch;
+    }
+
+    // later edits win where they overlap, a checkpoint replaces everything
+    // before it, both while queued and once written
+    void testRestoreOrdering()
+    {
+        {
+            CacheArchive archive;
+            TS_ASSERT( archive.open(m_path) );
+            MatrixJournal * journal = archive.journal();
+            patch( journal, cv::Rect( 0, 0, 16, 16 ), 1 );
+            patch( journal, cv::Rect( 8, 8, 16, 16 ), 2 );
+
+            cv::Mat mask = restore(journal);
+            TS_ASSERT_EQUALS( mask.at<uchar>( 4, 4 ), 1 );
+            TS_ASSERT_EQUALS( mask.at<uchar>( 10, 10 ), 2 );
+            TS_ASSERT_EQUALS( mask.at<uchar>( 20, 20 ), 2 );
+            TS_ASSERT_EQUALS( mask.at<uchar>( 30, 30 ), 0 );
+
+            journal->checkpoint( m_hash, "mask", cv::Mat( m_size, CV_8UC1, cv::Scalar(5) ) );
+            patch( journal, cv::Rect( 0, 0, 4, 4 ), 7 );
+            checkCheckpointed( restore(journal) );
+        }
+
+        CacheArchive archive;
+        TS_ASSERT( archive.open(m_path) );
+        checkCheckpointed( restore( archive.journal() ) );
+    }
+
+    void testClear()
+    {
+        CacheArchive archive;
+        TS_ASSERT( archive.open(m_path) );
+        MatrixJournal * journal = archive.journal();
+        journal->checkpoint( m_hash, "mask", cv::Mat( m_size, CV_8UC1, cv::Scalar(5) ) );
+        patch( journal, cv::Rect( 8, 8, 4, 4 ), 7 );
+        journal->clear( m_hash, "mask" );
+        TS_ASSERT( restore(journal).empty() );
+
+        patch( journal, cv::Rect( 0, 0, 2, 2 ), 9 );
+        journal->flush();
+        cv::Mat mask = restore(journal);
+        TS_ASSERT_EQUALS( mask.at<uchar>( 0, 0 ), 9 );
+        TS_ASSERT_EQUALS( mask.at<uchar>( 10, 10 ), 0 );
+        TS_ASSERT_EQUALS( mask.at<uchar>( 30, 30 ), 0 );
+    }
+
+    void testRemovingCheckpoint()
+    {
+        CacheArchive archive;
+        TS_ASSERT( archive.open(m_path) );
+        MatrixJournal * journal = archive.journal();
+        journal->checkpoint( m_hash, "mask", cv::Mat( m_size, CV_8UC1, cv::Scalar(5) ) );
+        journal->flush();
+        TS_ASSERT( archive.contains( m_hash, "mask" ) );
+
+        journal->checkpoint( m_hash, "mask", cv::Mat() );
+        TS_ASSERT( restore(journal).empty() );
+        journal->flush();
+        TS_ASSERT( !archive.contains( m_hash, "mask" ) );
+    }
+
+protected:
+    ScratchDirectory * m_scratch;
+    QString m_path;
+    QByteArray m_hash;
+    cv::Size m_size;
+
+    void patch( MatrixJournal * journal, const cv::Rect& roi, int value )
+    {
+        journal->patch( m_hash, "mask", roi, cv::Mat( roi.size(), CV_8UC1, cv::Scalar(value) ) );
+    }
+
+    cv::Mat restore( MatrixJournal * journal )
+    {
+        return journal->restore( m_hash, "mask", m_size, CV_8UC1 );
+    }
+
+    void checkCheckpointed( const cv::Mat& mask )
+    {
+        TS_ASSERT_EQUALS( mask.size(), m_size );
+        TS_ASSERT_EQUALS( mask.at<uchar>( 0, 0 ), 7 );
+        TS_ASSERT_EQUALS( mask.at<uchar>( 4, 4 ), 5 );
+        TS_ASSERT_EQUALS( mask.at<uchar>( 10, 10 ), 5 );
+        TS_ASSERT_EQUALS( mask.at<uchar>( 30, 30 ), 5 );
+    }
+};
@@ -0,0 +1,89 @@
+#include <cxxtest/TestSuite.h>
+
+#include "StageScheduler.hpp"
+
+using namespace QArtm;
+
+class StageSchedulerTest : public CxxTest::TestSuite {
+public:
+    struct NumberedJob : public StageJob {
+        int number;
+        explicit NumberedJob( int n ) : number(n) {}
+    };
+
+    // holds up job 0 until released and notes the order of the others
+    class RecordingStage : public StageScheduler::Stage {
+    public:
+        QMutex lock;
+        QList<int> order;
+        QSemaphore blocked, release, processed;
+
+        QString name() const { return "record"; }
+        bool process( StageJob * job )
+        {
+            int number = static_cast<NumberedJob*>(job)->number;
+            if (number == 0) {
+                blocked.release();
+                release.acquire();
+            } else {
+                QMutexLocker locker(&lock);
+                order << number;
+            }
+            processed.release();
+            return true;
+        }
+    };
+
+    // with one worker stuck, the other empties its own queue front to back
+    // and then steals the oldest jobs first
+    void testStealingOrder()
+    {
+        StageScheduler scheduler( 2, QThread::NormalPriority );
+        RecordingStage * stage = new RecordingStage;
+        scheduler.addStage(stage);
+
+        // queued round robin: 0 2 4 6 to one worker, 1 3 5 7 to the other
+        scheduler.setPaused(true);
+        for(int i = 0; i < 8; i++)
+            scheduler.submit( StageJobPtr( new NumberedJob(i) ) );
+        scheduler.setPaused(false);
+
+        stage->blocked.acquire();
+        stage->processed.acquire(7);
+        QList<int> order;
+        {
+            QMutexLocker locker(&stage->lock);
+            order = stage->order;
+        }
+        stage->release.release();
+        scheduler.waitForIdle();
+
+        TS_ASSERT_EQUALS( order, QList<int>() << 1 << 3 << 5 << 7 << 2 << 4 << 6 );
+    }
+
+    // jobs under way go on through their stages, only fresh ones go
+    void testClearKeepsStartedJobs()
+    {
+        StageScheduler scheduler( 1, QThread::NormalPriority );
+        RecordingStage * first = new RecordingStage;
+        RecordingStage * second = new RecordingStage;
+        scheduler.addStage(first);
+        scheduler.addStage(second);
+
+        scheduler.submit( StageJobPtr( new NumberedJob(0) ) );
+        scheduler.submit( StageJobPtr( new NumberedJob(1) ) );
+        first->blocked.acquire();
+        scheduler.clear();
+        first->release.release();
+        // job 0 is held up in the second stage too, let it through
+        second->release.release();
+        scheduler.waitForIdle();
+
+        TS_ASSERT( first->order.isEmpty() );
+        TS_ASSERT_EQUALS( second->processed.available(), 1 );
+        QList< StageScheduler::StageStats > stats = scheduler.stats();
+        TS_ASSERT_EQUALS( stats[0].done, 1u );
+        TS_ASSERT_EQUALS( stats[0].queued, 0 );
+        TS_ASSERT_EQUALS( stats[1].done, 1u );
+    }
+};
@@ -0,0 +1,119 @@
+#include <cxxtest/TestSuite.h>
+
+#include "TiledCounter.hpp"
+#include "ScratchDirectory.h"
+
+using namespace QArtm;
+
+class TiledCounterTest : public CxxTest::TestSuite {
+public:
+    void setUp()
+    {
+        m_scratch = new ScratchDirectory("TiledCounterTest");
+        m_colors << cv::Scalar( 40, 170, 60 ) << cv::Scalar( 230, 90, 160 ) << cv::Scalar( 240, 220, 40 );
+
+        // a patch of each card color to learn the palette from
+        cv::Mat training( 60, 60 * CountingEngine::CARD_COLORS, CV_8UC3 );
+        QList< cv::Mat > masks;
+        for(int color = 0; color < CountingEngine::CARD_COLORS; color++) {
+            cv::Rect patch( 60 * color, 0, 60, 60 );
+            training( patch ).setTo( m_colors[color] );
+            masks << cv::Mat( training.size(), CV_8UC1, cv::Scalar(0) );
+            masks.last()( patch ).setTo( cv::Scalar(1) );
+        }
+        addNoise( training );
+        m_engine = new CountingEngine;
+        m_engine->setPalette( CountingEngine::learnPalette( CountingEngine::toLab(training), masks ) );
+
+        // cards within a tile, across tile borders, across a tile corner,
+        // over three tiles, a frame with a card in its hole and a speck
+        m_photo = cv::Mat( 1500, 2300, CV_8UC3, cv::Scalar( 128, 128, 128 ) );
+        card( 0, cv::Rect( 100, 100, 80, 60 ) );
+        card( 0, cv::Rect( 990, 500, 80, 60 ) );
+        card( 0, cv::Rect( 900, 200, 1300, 40 ) );
+        card( 0, cv::Rect( 1500, 1300, 5, 5 ) );
+        card( 1, cv::Rect( 1200, 300, 60, 90 ) );
+        card( 1, cv::Rect( 600, 990, 70, 80 ) );
+        card( 2, cv::Rect( 300, 1100, 90, 60 ) );
+        card( 2, cv::Rect( 1000, 1000, 60, 60 ) );
+        card( 2, cv::Rect( 1980, 600, 150, 150 ) );
+        m_photo( cv::Rect( 2010, 630, 90, 90 ) ).setTo( cv::Scalar( 128, 128, 128 ) );
+        card( 2, cv::Rect( 2030, 650, 40, 40 ) );
+        addNoise( m_photo );
+    }
+
+    void tearDown()
+    {
+        delete m_engine;
+        delete m_scratch;
+    }
+
+    void testMatchesWholeImage()
+    {
+        const int threshold = 10, sizeFilter = 10;
+        cv::Mat indices, dists;
+        m_engine->classify( CountingEngine::toLab(m_photo), indices, dists );
+        CountingEngine::Result whole = CountingEngine::count( indices, dists, threshold, sizeFilter );
+        TS_ASSERT_EQUALS( whole.counts(), QVector<int>() << 3 << 2 << 3 );
+
+        QMap< QString, int > timings;
+        cv::Mat colors = TiledCounter( *m_engine ).cardColors( m_photo, threshold, timings );
+        QVector< CountingEngine::Contours > tiled = TiledCounter::cards( colors, sizeFilter );
+        TS_ASSERT_EQUALS( tiled.size(), whole.cards.size() );
+        for(int color = 0; color < tiled.size() && color < whole.cards.size(); color++)
+            TS_ASSERT_EQUALS( areas( tiled[color] ), areas( whole.cards[color] ) );
+    }
+
+    // decoding band by band gives the card colors of the decoded photo
+    void testBandedDecode()
+    {
+        QString path = m_scratch->filePath("photo.png");
+        TS_ASSERT( QImage( m_photo.data, m_photo.cols, m_photo.rows, m_photo.step, QImage::Format_RGB888 )
+                   .save( path, "PNG" ) );
+
+        QMap< QString, int > timings;
+        TiledCounter counter( *m_engine );
+        cv::Mat whole = counter.cardColors( m_photo, 10, timings );
+        cv::Mat banded = counter.cardColors( path, 10, timings );
+        TS_ASSERT_EQUALS( banded.size(), whole.size() );
+        TS_ASSERT_EQUALS( banded.type(), whole.type() );
+        if (banded.size() == whole.size())
+            TS_ASSERT_EQUALS( cv::countNonZero( banded != whole ), 0 );
+        TS_ASSERT( timings.contains("decode") );
+
+        TS_ASSERT( counter.cardColors( m_scratch->filePath("missing.png"), 10, timings ).empty() );
+    }
+
+protected:
+    ScratchDirectory * m_scratch;
+    QList< cv::Scalar > m_colors;
+    CountingEngine * m_engine;
+    cv::Mat m_photo;
+
+    void card( int color, const cv::Rect& rect )
+    {
+        m_photo( rect ).setTo( m_colors[color] );
+    }
+
+    // a few levels either way, so the palette has gradations to learn
+    static void addNoise( cv::Mat& rgb )
+    {
+        cv::Mat noise( rgb.size(), CV_16SC3 );
+        cv::randu( noise, cv::Scalar::all(-6), cv::Scalar::all(6) );
+        cv::Mat noisy;
+        rgb.convertTo( noisy, CV_16SC3 );
+        noisy += noise;
+        noisy.convertTo( rgb, CV_8UC3 );
+    }
+
+    // contours traced in another order or from another start still have
+    // the same areas
+    static QList<double> areas( const CountingEngine::Contours& contours )
+    {
+        QList<double> result;
+        for(size_t i = 0; i < contours.size(); i++)
+            result << cv::contourArea( contours[i] );
+        qSort(result);
+        return result;
+    }
+};